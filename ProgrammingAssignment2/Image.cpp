@@ -1,65 +1,662 @@
 #include "Image.hpp"
+#include "ImageConvolve.hpp"
+#include "ImageIntegral.hpp"
+#include "ImageSimd.hpp"
+#include "ImageStream.hpp"
+#include "ImageThreads.hpp"
 
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
 #include <fstream>
+#include <mutex>
+#include <vector>
 
 using namespace std;
 
+// Rows are aligned (and padded) to this many bytes
+#define IMAGE_ROW_ALIGNMENT 64
+
+// Number of pixels each fused point operation processes before the next one runs.
+// 2048 RGBA pixels (8 KB) stay in L1 between operations
+#define IMAGE_TILE_PIXELS 2048
+
+// A point operation with everything that can be computed ahead of time resolved
+typedef struct {
+    ImagePointOpType type;
+    int factor; // fixed-point factor for the ImageSimd kernels
+    quint32 mask;
+    uchar table[256];
+} PreparedPointOp;
+
+// One step PointOps applies to each tile: a Saturation, or a run of per-channel
+// operations compiled into lookup tables in the ImageSimd Lut layout
+typedef struct {
+    const PreparedPointOp *saturation; // NULL for a table
+    ImagePixel ramp[256]; // ramp[v] is what each channel's value v has become so far
+    quint32 table[4 * 256];
+} PointStage;
+
+static inline uchar ClampFloat(float v)
+{
+    return v <= 0 ? 0 : v >= 255 ? 255 : (uchar)(v + 0.5f);
+}
+
+// A pixel buffer and the number of Images using it. Copies and views share a buffer,
+// possibly from different threads, so the count is atomic
+struct ImageBuffer {
+    std::atomic<int> references;
+    ImagePixel *data; // what qMallocAligned returned or the file was mapped to
+    QFile *mapping; // the file data is a private mapping of, or NULL if it was allocated
+    // The pixels the buffer was made for, and the padding around them
+    ImagePixel *origin;
+    int width, height, apron;
+    // The border the apron holds, and how many pixels of it; 0 once the pixels change
+    ImageBorder border;
+    int filled;
+};
+
 Image::Image()
-: npixels(0), width(0), height(0)
+: pixels(NULL), buffer(NULL), stride(0), width(0), height(0), npixels(0), statsValid(false)
 {}
 
 Image::Image(const char *filename)
-    : npixels(0), width(0), height(0)
+    : pixels(NULL), buffer(NULL), stride(0), width(0), height(0), npixels(0), statsValid(false)
 {
     if (!Read(filename)){
         printf("Image not created");
     }
 }
 
+Image::Image(int width, int height)
+    : pixels(NULL), buffer(NULL), stride(0), width(0), height(0), npixels(0), statsValid(false)
+{
+    int new_stride;
+    ImagePixel *new_pixels = Allocate(width, height, &new_stride);
+    Replace(new_pixels, width, height, new_stride);
+}
+
+Image::Image(const Image &other)
+    : pixels(NULL), buffer(NULL), stride(0), width(0), height(0), npixels(0), statsValid(false)
+{
+    *this = other;
+}
+
+Image &Image::operator=(const Image &other)
+{
+    if (this == &other) {
+        return *this;
+    }
+    // Take the reference first, other may be a view of this image's own buffer
+    if (other.buffer) {
+        other.buffer->references++;
+    }
+    Release();
+    pixels = other.pixels;
+    buffer = other.buffer;
+    stride = other.stride;
+    width = other.width;
+    height = other.height;
+    npixels = other.npixels;
+    // The same pixels have the same statistics
+    stats = other.stats;
+    statsValid = other.statsValid;
+    return *this;
+}
+
 Image::~Image() {
-    //delete image_data;
+    Release();
+}
+
+// Per thread, so operations running at the same time on other threads do not count
+static thread_local quint64 allocatedBytes = 0;
+
+quint64 Image::AllocatedBytes()
+{
+    return allocatedBytes;
+}
+
+ImagePixel *Image::Allocate(int width, int height, int *stride, int apron)
+{
+    const int align = IMAGE_ROW_ALIGNMENT / sizeof(ImagePixel);
+    *stride = (width + 2 * apron + align - 1) / align * align;
+    size_t bytes = (size_t)*stride * (height + 2 * apron) * sizeof(ImagePixel);
+    ImagePixel *buffer = (ImagePixel *)qMallocAligned(bytes, IMAGE_ROW_ALIGNMENT);
+    if (!buffer) {
+        fputs("Unable to allocate image buffer\n", stderr);
+        exit(-1);
+    }
+    allocatedBytes += bytes;
+    return buffer + (size_t)apron * *stride + apron;
+}
+
+void Image::Free(ImagePixel *pixels, int stride, int apron)
+{
+    qFreeAligned(pixels - (size_t)apron * stride - apron);
+}
+
+void Image::Replace(ImagePixel *new_pixels, int new_width, int new_height, int new_stride, int apron,
+                    QFile *mapping)
+{
+    Release();
+    if (mapping) {
+        apron = 0;
+    }
+    buffer = new ImageBuffer;
+    buffer->references = 1;
+    buffer->data = new_pixels - (size_t)apron * new_stride - apron;
+    buffer->mapping = mapping;
+    buffer->origin = new_pixels;
+    buffer->width = new_width;
+    buffer->height = new_height;
+    buffer->apron = apron;
+    buffer->border = IMAGE_BORDER_CLAMP;
+    buffer->filled = 0;
+    pixels = new_pixels;
+    stride = new_stride;
+    width = new_width;
+    height = new_height;
+    npixels = width * height;
+    statsValid = false;
+}
+
+void Image::Release()
+{
+    if (buffer && --buffer->references == 0) {
+        if (buffer->mapping) {
+            // Closing the file unmaps it
+            delete buffer->mapping;
+        }
+        else {
+            qFreeAligned(buffer->data);
+        }
+        delete buffer;
+    }
+    buffer = NULL;
+    pixels = NULL;
+}
+
+void Image::Detach()
+{
+    if (!buffer || buffer->references == 1) {
+        return;
+    }
+    int new_stride;
+    ImagePixel *new_pixels = Allocate(width, height, &new_stride);
+    ImageParallelRows(height, [&](int first, int end) {
+        for (int y = first; y < end; y++) {
+            memcpy(new_pixels + (size_t)y * new_stride, Row(y), width * sizeof(ImagePixel));
+        }
+    });
+    bool valid = statsValid;
+    Replace(new_pixels, width, height, new_stride);
+    statsValid = valid;
+}
+
+void Image::PixelsChanged()
+{
+    statsValid = false;
+    if (buffer) {
+        buffer->filled = 0;
+    }
+}
+
+void Image::FillApron(int radius, ImageBorder border)
+{
+    if (radius <= 0 || width == 0 || height == 0) {
+        return;
+    }
+    bool room = buffer && pixels == buffer->origin && width == buffer->width && height == buffer->height &&
+                radius <= buffer->apron;
+    if (room && buffer->border == border && radius <= buffer->filled) {
+        return;
+    }
+    if (!room || buffer->references > 1) {
+        const int align = IMAGE_ROW_ALIGNMENT / sizeof(ImagePixel);
+        int apron = qMax(IMAGE_APRON, (radius + align - 1) / align * align);
+        int new_stride;
+        ImagePixel *padded = Allocate(width, height, &new_stride, apron);
+        ImageParallelRows(height, [&](int first, int end) {
+            for (int y = first; y < end; y++) {
+                memcpy(padded + (size_t)y * new_stride, Row(y), width * sizeof(ImagePixel));
+            }
+        });
+        bool valid = statsValid;
+        Replace(padded, width, height, new_stride, apron);
+        statsValid = valid;
+    }
+    // The ends of every row, then whole padded rows above and below, corners included
+    const ImagePixel black = { 0, 0, 0, 0xff };
+    ImageParallelRows(height, [&](int first, int end) {
+        for (int y = first; y < end; y++) {
+            ImagePixel *row = Row(y);
+            for (int x = 1; x <= radius; x++) {
+                row[-x] = border == IMAGE_BORDER_ZERO ? black : row[ImageBorderIndex(-x, width, border)];
+                row[width - 1 + x] =
+                    border == IMAGE_BORDER_ZERO ? black : row[ImageBorderIndex(width - 1 + x, width, border)];
+            }
+        }
+    });
+    for (int y = 1; y <= radius; y++) {
+        int rows[2] = { -y, height - 1 + y };
+        for (int i = 0; i < 2; i++) {
+            ImagePixel *row = Row(rows[i]) - radius;
+            if (border == IMAGE_BORDER_ZERO) {
+                for (int x = 0; x < width + 2 * radius; x++) {
+                    row[x] = black;
+                }
+            }
+            else {
+                memcpy(row, Row(ImageBorderIndex(rows[i], height, border)) - radius,
+                       (width + 2 * radius) * sizeof(ImagePixel));
+            }
+        }
+    }
+    buffer->border = border;
+    buffer->filled = radius;
 }
 
 bool Image::Read(const char *filename)
 {
-    // load image file
-    QImage image(QString(filename), "JPG");
-    if (image.isNull()) {
+    return Read(filename, IMAGE_FORMAT_JPG);
+}
+
+
+bool Image::Read(const char *filename, ImageFileFormat format)
+{
+    if (format == IMAGE_FORMAT_JPG) {
+        // load image file
+        QImage image(QString(filename), "JPG");
+        if (image.isNull()) {
+            return IMAGE_RETURN_FAILURE;
+        }
+        // convert to 32-bit image where each pixel is byte-ordered RGBA, the same as ImagePixel
+        image = image.convertToFormat(QImage::Format_RGBA8888);
+        if (image.isNull()) {
+            return IMAGE_RETURN_FAILURE;
+        }
+
+        // copy the scanlines into our own aligned buffer; operators never touch the QImage
+        int new_stride;
+        ImagePixel *new_pixels = Allocate(image.width(), image.height(), &new_stride);
+        ImageParallelRows(image.height(), [&](int first, int end) {
+            for (int y = first; y < end; y++) {
+                memcpy(new_pixels + (size_t)y * new_stride, image.constScanLine(y), image.width() * sizeof(ImagePixel));
+            }
+        });
+        Replace(new_pixels, image.width(), image.height(), new_stride);
+        return IMAGE_RETURN_SUCCESS;
+    }
+
+    QFile *file = new QFile(QString(filename));
+    int new_width, new_height, channels;
+    bool big_endian = false;
+    if (!file->open(QIODevice::ReadOnly) ||
+        !ImageReadHeader(*file, format, &new_width, &new_height, &channels, &big_endian)) {
+        delete file;
         return IMAGE_RETURN_FAILURE;
     }
-    // convert to 32-bit image where each pixel is a QRgb
-    image_data = image.convertToFormat(QImage::Format_RGB32);
-    if (image_data.isNull()) {
+    int sample = format == IMAGE_FORMAT_PFM ? sizeof(float) : 1;
+    qint64 offset = file->pos(), length = (qint64)new_width * new_height * channels * sample;
+    if (file->size() < offset + length) {
+        delete file;
         return IMAGE_RETURN_FAILURE;
     }
+    // A private mapping is copy-on-write, so operators may write to it freely
+    uchar *data = file->map(offset, length, QFileDevice::MapPrivateOption);
+    if (!data) {
+        delete file;
+        return IMAGE_RETURN_FAILURE;
+    }
+    if (channels == 4 && (quintptr)data % sizeof(ImagePixel) == 0) {
+        // The file's RGBA bytes are laid out exactly like ImagePixel rows
+        Replace((ImagePixel *)data, new_width, new_height, new_width, 0, file);
+        return IMAGE_RETURN_SUCCESS;
+    }
 
-    width = image_data.width();
-    height = image_data.height();
-    npixels = width * height;
-
-    QImage new_data(500,1000, QImage::Format_RGB32);
-    QColor color(50,50,50);
-    new_data.setPixel(50, 87, color.rgb());
-
+    int new_stride;
+    ImagePixel *new_pixels = Allocate(new_width, new_height, &new_stride);
+    ImageParallelRows(new_height, [&](int first, int end) {
+        for (int y = first; y < end; y++) {
+            ImagePixel *out = new_pixels + (size_t)y * new_stride;
+            if (format == IMAGE_FORMAT_PFM) {
+                // PFM stores the bottom row first
+                const uchar *in = data + (size_t)(new_height - 1 - y) * new_width * channels * sizeof(float);
+                for (int x = 0; x < new_width; x++) {
+                    float v[3];
+                    for (int c = 0; c < 3; c++) {
+                        const uchar *b = in + (x * channels + (channels == 3 ? c : 0)) * sizeof(float);
+                        uchar bytes[4] = { b[0], b[1], b[2], b[3] };
+                        if (big_endian != (Q_BYTE_ORDER == Q_BIG_ENDIAN)) {
+                            qSwap(bytes[0], bytes[3]);
+                            qSwap(bytes[1], bytes[2]);
+                        }
+                        memcpy(&v[c], bytes, sizeof(float));
+                    }
+                    out[x].r = ClampFloat(v[0] * 255);
+                    out[x].g = ClampFloat(v[1] * 255);
+                    out[x].b = ClampFloat(v[2] * 255);
+                    out[x].a = 0xff;
+                }
+            }
+            else {
+                const uchar *in = data + (size_t)y * new_width * channels;
+                for (int x = 0; x < new_width; x++) {
+                    out[x].r = in[x * channels];
+                    out[x].g = in[x * channels + 1];
+                    out[x].b = in[x * channels + 2];
+                    out[x].a = channels == 4 ? in[x * channels + 3] : 0xff;
+                }
+            }
+        }
+    });
+    delete file;
+    Replace(new_pixels, new_width, new_height, new_stride);
     return IMAGE_RETURN_SUCCESS;
 }
 
 
 bool Image::Write(const char *filename)
 {
-    if (image_data.save(QString(filename), "JPG")) {
-        return IMAGE_RETURN_SUCCESS;
-    } else {
+    return Write(filename, IMAGE_FORMAT_JPG);
+}
+
+
+bool Image::Write(const char *filename, ImageFileFormat format)
+{
+    if (format == IMAGE_FORMAT_JPG) {
+        // wrap the pixel buffer without copying it
+        QImage image((const uchar *)pixels, width, height, stride * sizeof(ImagePixel), QImage::Format_RGBA8888);
+        if (image.save(QString(filename), "JPG")) {
+            return IMAGE_RETURN_SUCCESS;
+        } else {
+            return IMAGE_RETURN_FAILURE;
+        }
+    }
+
+    // Truncating the file pixels are mapped from would pull pages out from under them,
+    // whatever name it is reached by
+    if (buffer && buffer->mapping && ImageSameFile(buffer->mapping->fileName(), QString(filename))) {
+        // The copy shares the mapping until Detach gives it pixels of its own
+        Image copy(*this);
+        copy.Detach();
+        return copy.Write(filename, format);
+    }
+    char header[IMAGE_HEADER_LENGTH];
+    int header_length = ImageWriteHeader(header, format, width, height);
+    int channels = format == IMAGE_FORMAT_PAM ? 4 : 3;
+    int sample = format == IMAGE_FORMAT_PFM ? sizeof(float) : 1;
+    qint64 length = (qint64)width * height * channels * sample;
+    QFile file;
+    file.setFileName(QString(filename));
+    if (!file.open(QIODevice::ReadWrite | QIODevice::Truncate) ||
+        file.write(header, header_length) != header_length ||
+        !file.resize(header_length + length)) {
+        return IMAGE_RETURN_FAILURE;
+    }
+    // Fill the file through a shared mapping, so rows are converted in parallel straight
+    // into the page cache
+    uchar *data = length > 0 ? file.map(header_length, length) : NULL;
+    if (length > 0 && !data) {
         return IMAGE_RETURN_FAILURE;
     }
+    ImageParallelRows(height, [&](int first, int end) {
+        for (int y = first; y < end; y++) {
+            const ImagePixel *in = Row(y);
+            if (format == IMAGE_FORMAT_PAM) {
+                memcpy(data + (size_t)y * width * sizeof(ImagePixel), in, width * sizeof(ImagePixel));
+            }
+            else if (format == IMAGE_FORMAT_PFM) {
+                // Little-endian, bottom row first
+                uchar *out = data + (size_t)(height - 1 - y) * width * 3 * sizeof(float);
+                for (int x = 0; x < width; x++) {
+                    float v[3] = { in[x].r / 255.0f, in[x].g / 255.0f, in[x].b / 255.0f };
+                    for (int c = 0; c < 3; c++) {
+                        uchar bytes[4];
+                        memcpy(bytes, &v[c], sizeof(float));
+                        if (Q_BYTE_ORDER == Q_BIG_ENDIAN) {
+                            qSwap(bytes[0], bytes[3]);
+                            qSwap(bytes[1], bytes[2]);
+                        }
+                        memcpy(out + (x * 3 + c) * sizeof(float), bytes, sizeof(float));
+                    }
+                }
+            }
+            else {
+                uchar *out = data + (size_t)y * width * 3;
+                for (int x = 0; x < width; x++) {
+                    out[3 * x] = in[x].r;
+                    out[3 * x + 1] = in[x].g;
+                    out[3 * x + 2] = in[x].b;
+                }
+            }
+        }
+    });
+    if (data) {
+        file.unmap(data);
+    }
+    return IMAGE_RETURN_SUCCESS;
+}
+
+
+// The bilateral grid is only accurate once a cell spans a few pixels
+#define BILATERAL_GRID_MIN_SIGMA 3.0
+
+// Largest bilateral grid, in cells per image pixel, worth allocating
+#define BILATERAL_GRID_MAX_CELLS 4
+
+// Empty cells around the bilateral grid so its blur never runs off the edge
+#define BILATERAL_GRID_PAD 2
+
+static inline float Luminance(const ImagePixel &p)
+{
+    return 0.299f * p.r + 0.587f * p.g + 0.114f * p.b;
+}
+
+void Image::BilateralFilter(double rangesigma, double domainsigma, int first_row)
+{
+    if (rangesigma <= 0 || domainsigma <= 0) {
+        fputs("Bilateral sigmas must be positive real values\n", stderr);
+        exit(-1);
+    }
+    // Cells per row of pixels, so every strip of an image takes the same path
+    double cells = (width / domainsigma + 2 * BILATERAL_GRID_PAD + 1)
+                 * (255 / rangesigma + 2 * BILATERAL_GRID_PAD + 1) / domainsigma;
+    if (domainsigma >= BILATERAL_GRID_MIN_SIGMA && cells <= (double)BILATERAL_GRID_MAX_CELLS * width) {
+        BilateralFilterGrid(rangesigma, domainsigma, first_row);
+    }
+    else {
+        BilateralFilterDirect(rangesigma, domainsigma);
+    }
 }
 
 
-void Image::BilateralFilter(double rangesigma, double domainsigma)
+void Image::BilateralFilterDirect(double rangesigma, double domainsigma)
 {
-    printf("Must implement BilateralFilter()\n");
+    if (rangesigma <= 0 || domainsigma <= 0) {
+        fputs("Bilateral sigmas must be positive real values\n", stderr);
+        exit(-1);
+    }
+    int radius = qCeil(3 * domainsigma);
+    int size = 2 * radius + 1;
+    float *domain = (float *)malloc(size * size * sizeof(float));
+    for (int j = -radius; j <= radius; j++) {
+        for (int i = -radius; i <= radius; i++) {
+            domain[(j + radius) * size + i + radius] = exp(-(i * i + j * j) / (2 * domainsigma * domainsigma));
+        }
+    }
+    // Luminances are compared to the nearest level, so the range weights fit a table
+    float range[256];
+    for (int d = 0; d < 256; d++) {
+        range[d] = exp(-(d * d) / (2 * rangesigma * rangesigma));
+    }
+    uchar *lum = (uchar *)malloc(npixels);
+    ImageParallelRows(height, [&](int first, int end) {
+        for (int y = first; y < end; y++) {
+            const ImagePixel *row = Row(y);
+            for (int x = 0; x < width; x++) {
+                lum[y * width + x] = (uchar)(Luminance(row[x]) + 0.5f);
+            }
+        }
+    });
+    int new_stride;
+    ImagePixel *filtered = Allocate(width, height, &new_stride);
+    ImageParallelRows(height, [&](int first, int end) {
+        for (int y = first; y < end; y++) {
+            ImagePixel *out = filtered + (size_t)y * new_stride;
+            for (int x = 0; x < width; x++) {
+                int center = lum[y * width + x];
+                float r = 0, g = 0, b = 0, total = 0;
+                // Neighbors outside the image are left out
+                for (int sy = qMax(y - radius, 0); sy <= qMin(y + radius, height - 1); sy++) {
+                    const ImagePixel *row = Row(sy);
+                    const uchar *lumRow = lum + sy * width;
+                    const float *domainRow = domain + (sy - y + radius) * size + radius - x;
+                    for (int sx = qMax(x - radius, 0); sx <= qMin(x + radius, width - 1); sx++) {
+                        float w = domainRow[sx] * range[qAbs(lumRow[sx] - center)];
+                        r += w * row[sx].r;
+                        g += w * row[sx].g;
+                        b += w * row[sx].b;
+                        total += w;
+                    }
+                }
+                out[x].r = ClampFloat(r / total);
+                out[x].g = ClampFloat(g / total);
+                out[x].b = ClampFloat(b / total);
+                out[x].a = Row(y)[x].a;
+            }
+        }
+    });
+    free(lum);
+    free(domain);
+    Replace(filtered, width, height, new_stride);
+}
+
+
+// Blurs n grid cells (4 floats each, step floats apart) with the binomial kernel
+// [1 4 6 4 1] / 16, a gaussian of sigma 1 cell. scratch holds 4 * n floats
+static void BlurGridLine(float *data, int n, size_t step, float *scratch)
+{
+    for (int i = 0; i < n; i++) {
+        for (int c = 0; c < 4; c++) {
+            scratch[4 * i + c] = data[i * step + c];
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        for (int c = 0; c < 4; c++) {
+            float sum = 6 * scratch[4 * i + c];
+            if (i >= 1) sum += 4 * scratch[4 * (i - 1) + c];
+            if (i >= 2) sum += scratch[4 * (i - 2) + c];
+            if (i + 1 < n) sum += 4 * scratch[4 * (i + 1) + c];
+            if (i + 2 < n) sum += scratch[4 * (i + 2) + c];
+            data[i * step + c] = sum * (1.0f / 16);
+        }
+    }
+}
+
+void Image::BilateralFilterGrid(double rangesigma, double domainsigma, int first_row)
+{
+    // Grid cells hold (r, g, b, weight) sums, indexed [gy][gx][gz] so a cell's luminance
+    // column is contiguous. Pixel (x, y) with luminance l lands at
+    // (x / domainsigma, (first_row + y) / domainsigma - top, l / rangesigma) + pad, where
+    // top is the cell of the first row, so a strip's cells are those of the whole image
+    const int pad = BILATERAL_GRID_PAD;
+    float sx = 1 / domainsigma, sz = 1 / rangesigma;
+    int top = (int)(first_row * sx + 0.5f);
+    // One past the cells the last column, row and luminance round to, computed as the
+    // splat rounds them
+    const ImagePixel white = { 0xff, 0xff, 0xff, 0xff };
+    int cellsX = (int)((width - 1) * sx + 0.5f) + 1,
+        cellsY = (int)((first_row + height - 1) * sx + 0.5f) + 1 - top;
+    int gw = cellsX + 2 * pad, gh = cellsY + 2 * pad, gd = (int)(Luminance(white) * sz + 0.5f) + 1 + 2 * pad;
+    size_t rowFloats = (size_t)gw * gd * 4;
+    float *grid = (float *)calloc(rowFloats * gh, sizeof(float));
+
+    // Splat every pixel into its nearest cell. Each grid row gathers its own pixel rows,
+    // so bands never write the same cells
+    ImageParallelRows(cellsY, [&](int first, int end) {
+        for (int gy = first; gy < end; gy++) {
+            int y0 = qMax(qFloor((top + gy - 0.5) * domainsigma) - first_row, 0),
+                y1 = qMin(qCeil((top + gy + 0.5) * domainsigma) + 1 - first_row, height);
+            for (int y = y0; y < y1; y++) {
+                if ((int)((first_row + y) * sx + 0.5f) - top != gy) {
+                    continue;
+                }
+                const ImagePixel *row = Row(y);
+                float *gridRow = grid + (gy + pad) * rowFloats;
+                for (int x = 0; x < width; x++) {
+                    int gx = (int)(x * sx + 0.5f) + pad, gz = (int)(Luminance(row[x]) * sz + 0.5f) + pad;
+                    float *cell = gridRow + ((size_t)gx * gd + gz) * 4;
+                    cell[0] += row[x].r;
+                    cell[1] += row[x].g;
+                    cell[2] += row[x].b;
+                    cell[3] += 1;
+                }
+            }
+        }
+    });
+
+    // Blur along luminance and x within each grid row, then along y within each column
+    ImageParallelRows(gh, [&](int first, int end) {
+        float *scratch = (float *)malloc(4 * qMax(gw, gd) * sizeof(float));
+        for (int gy = first; gy < end; gy++) {
+            float *gridRow = grid + gy * rowFloats;
+            for (int gx = 0; gx < gw; gx++) {
+                BlurGridLine(gridRow + (size_t)gx * gd * 4, gd, 4, scratch);
+            }
+            for (int gz = 0; gz < gd; gz++) {
+                BlurGridLine(gridRow + gz * 4, gw, (size_t)gd * 4, scratch);
+            }
+        }
+        free(scratch);
+    });
+    ImageParallelRows(gw, [&](int first, int end) {
+        float *scratch = (float *)malloc(4 * gh * sizeof(float));
+        for (int gx = first; gx < end; gx++) {
+            for (int gz = 0; gz < gd; gz++) {
+                BlurGridLine(grid + ((size_t)gx * gd + gz) * 4, gh, rowFloats, scratch);
+            }
+        }
+        free(scratch);
+    });
+
+    // Slice: trilinearly interpolate the grid at each pixel's position and luminance
+    Detach();
+    ImageParallelRows(height, [&](int first, int end) {
+        for (int y = first; y < end; y++) {
+            ImagePixel *row = Row(y);
+            // The fraction comes from the image row alone, so it rounds the same in a strip
+            float fy = (first_row + y) * sx;
+            int gy = (int)fy;
+            float ty = fy - gy;
+            gy += pad - top;
+            for (int x = 0; x < width; x++) {
+                float fx = x * sx + pad, fz = Luminance(row[x]) * sz + pad;
+                int gx = (int)fx, gz = (int)fz;
+                float tx = fx - gx, tz = fz - gz;
+                float sum[4] = { 0, 0, 0, 0 };
+                for (int k = 0; k < 8; k++) {
+                    int dy = k >> 2, dx = (k >> 1) & 1, dz = k & 1;
+                    float w = (dy ? ty : 1 - ty) * (dx ? tx : 1 - tx) * (dz ? tz : 1 - tz);
+                    const float *cell = grid + (gy + dy) * rowFloats + ((size_t)(gx + dx) * gd + gz + dz) * 4;
+                    for (int c = 0; c < 4; c++) {
+                        sum[c] += w * cell[c];
+                    }
+                }
+                // The colors are weighted by the same cells as the weight, so however small
+                // it is the quotient stays in range; only an empty neighborhood is skipped
+                if (sum[3] <= 0) {
+                    continue;
+                }
+                row[x].r = ClampFloat(sum[0] / sum[3]);
+                row[x].g = ClampFloat(sum[1] / sum[3]);
+                row[x].b = ClampFloat(sum[2] / sum[3]);
+            }
+        }
+    });
+    free(grid);
+    PixelsChanged();
 }
 
 
@@ -69,75 +666,198 @@ void Image::BlackAndWhite()
 }
 
 
-void Image::Brightness(double factor)
+void Image::BoxBlur(int radius, ImageBorder border)
 {
-    if (factor < 0 || 2 < factor) {
-        fputs("Brightness alpha factor must be in the range [0.0, 2.0]\n", stderr);
+    if (radius < 0 || radius > IMAGE_BOX_BLUR_MAX_RADIUS) {
+        fputs("Box blur radius must be a non-negative integer no greater than 16777216\n", stderr);
         exit(-1);
     }
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            QColor color = QColor(image_data.pixel(x, y));
-            color.setRed(qMin(qRound(color.red() * factor), 255));
-            color.setGreen(qMin(qRound(color.green() * factor), 255));
-            color.setBlue(qMin(qRound(color.blue() * factor), 255));
-            image_data.setPixel(x, y, color.rgb());
-        }
+    if (radius == 0 || width == 0 || height == 0) {
+        return;
+    }
+    // The table covers the image only; a box reaching past the edges is summed as a few
+    // multiples of the table's entries (see ImageBorderSum), so neither memory nor time
+    // grows with radius
+    ImageIntegral integral(*this);
+    const int terms = IMAGE_BORDER_SUM_TERMS;
+    std::vector<int> column_index((size_t)width * terms), column_count(width);
+    std::vector<quint64> column_weight((size_t)width * terms);
+    for (int x = 0; x < width; x++) {
+        column_count[x] = ImageBorderSum(x - radius, x + radius + 1, width, border,
+                                         &column_index[(size_t)x * terms], &column_weight[(size_t)x * terms]);
     }
+    const qint64 side = 2 * (qint64)radius + 1;
+    const double scale = 1.0 / ((double)side * side);
+    int new_stride;
+    ImagePixel *blurred = Allocate(width, height, &new_stride);
+    ImageParallelRows(height, [&](int first, int end) {
+        // The rows' terms combined: entry x holds the sums over the box's rows and the
+        // columns [0, x)
+        std::vector<quint64> rows(4 * ((size_t)width + 1));
+        for (int y = first; y < end; y++) {
+            int row_index[terms];
+            quint64 row_weight[terms];
+            int row_count = ImageBorderSum(y - radius, y + radius + 1, height, border, row_index, row_weight);
+            for (size_t i = 0; i < rows.size(); i++) {
+                rows[i] = 0;
+            }
+            for (int t = 0; t < row_count; t++) {
+                const quint64 *row = integral.Row(row_index[t]);
+                for (size_t i = 0; i < rows.size(); i++) {
+                    rows[i] += row_weight[t] * row[i];
+                }
+            }
+            // Zero borders are opaque, so alpha adds 255 for each pixel of the box outside
+            qint64 inside_rows = qMin<qint64>(y + radius + 1, height) - qMax(y - radius, 0);
+            ImagePixel *out = blurred + (size_t)y * new_stride;
+            for (int x = 0; x < width; x++) {
+                const int *index = &column_index[(size_t)x * terms];
+                const quint64 *weight = &column_weight[(size_t)x * terms];
+                quint64 sum[4] = { 0, 0, 0, 0 };
+                for (int t = 0; t < column_count[x]; t++) {
+                    for (int c = 0; c < 4; c++) {
+                        sum[c] += weight[t] * rows[4 * index[t] + c];
+                    }
+                }
+                if (border == IMAGE_BORDER_ZERO) {
+                    qint64 inside_columns = qMin<qint64>(x + radius + 1, width) - qMax(x - radius, 0);
+                    sum[3] += 255 * (quint64)(side * side - inside_columns * inside_rows);
+                }
+                uchar *result = &out[x].r;
+                for (int c = 0; c < 4; c++) {
+                    // Through a signed integer, which converts to double in one instruction
+                    result[c] = (uchar)((qint64)sum[c] * scale + 0.5);
+                }
+            }
+        }
+    });
+    Replace(blurred, width, height, new_stride);
+}
+
+
+void Image::Brightness(double factor)
+{
+    ImagePointOp op = { IMAGE_OP_BRIGHTNESS, factor, 0 };
+    PointOps(&op, 1);
 }
 
 
 void Image::ChannelExtract(int channel)
 {
-    if (channel < 0 || 4 < channel) {
-        fputs("Channel must be one of 0=red, 1=green, 2=blue, 3=alpha\n", stderr);
+    ImagePointOp op = { IMAGE_OP_CHANNEL_EXTRACT, 0, channel };
+    PointOps(&op, 1);
+}
+
+
+// Checks that layer is as wide as the image and has rows [first_row, first_row + height)
+static void CheckLayer(const Image *layer, int width, int height, int first_row)
+{
+    if (layer && (layer->Width() != width || layer->Height() < first_row + height)) {
+        fputs("Composite layers and masks must be the same size as the image\n", stderr);
         exit(-1);
     }
-    // Create a mask for each pixel depending on the channel number
-    // Do channel++ since alpha is stored first in QRgb
-    if (channel++ == 3) channel = 0;
-    QRgb mask = 0xff << (3 - channel) * 8;
-    mask |= 0xff000000;
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            QRgb rgb = image_data.pixel(x, y);
-            image_data.setPixel(x, y, rgb & mask);
+}
+
+void Image::Composite(const ImageLayer *layers, int count, int first_row)
+{
+    for (int i = 0; i < count; i++) {
+        if (!layers[i].image || layers[i].operation < 0 || layers[i].operation >= IMAGE_COMPOSITE_OPERATIONS) {
+            fputs("Composite needs an image and an operation (0=over, 1=in, 2=out, 3=atop) for each layer\n", stderr);
+            exit(-1);
         }
+        CheckLayer(layers[i].bottom_mask, width, height, first_row);
+        CheckLayer(layers[i].image, width, height, first_row);
+        CheckLayer(layers[i].mask, width, height, first_row);
     }
+    const ImageSimdKernels *kernels = ImageSimd();
+    Detach();
+    ImageParallelRows(height, [&](int first, int end) {
+        ImagePixel source[IMAGE_TILE_PIXELS];
+        for (int y = first; y < end; y++) {
+            ImagePixel *row = Row(y);
+            int layer_y = first_row + y;
+            for (int x = 0; x < width; x += IMAGE_TILE_PIXELS) {
+                ImagePixel *tile = row + x;
+                int n = qMin(IMAGE_TILE_PIXELS, width - x);
+                for (int i = 0; i < count; i++) {
+                    const ImageLayer &layer = layers[i];
+                    const Image *bottom_mask = layer.bottom_mask, *mask = layer.mask;
+                    kernels->Premultiply(tile, tile, bottom_mask ? bottom_mask->Row(layer_y) + x : NULL, n);
+                    kernels->Premultiply(source, layer.image->Row(layer_y) + x, mask ? mask->Row(layer_y) + x : NULL, n);
+                    kernels->Composite(tile, source, n, layer.operation);
+                    kernels->Unpremultiply(tile, n);
+                }
+            }
+        }
+    });
+    PixelsChanged();
 }
 
 
-void Image::Composite()
+void Image::Contrast(double factor)
 {
-    printf("Must implement Composite()\n");
+    ImagePointOp op = { IMAGE_OP_CONTRAST, factor, 0, -1 };
+    PointOps(&op, 1);
 }
 
 
-void Image::Contrast(double factor)
+void Image::ContrastAround(double factor, double average_lum)
 {
-    if (factor < -1 || 2 < factor) {
-        fputs("Contrast alpha factor must be in the range [-1.0, 2.0]\n", stderr);
-        exit(-1);
+    ImagePointOp op = { IMAGE_OP_CONTRAST, factor, 0, average_lum };
+    PointOps(&op, 1);
+}
+
+
+void ImageStatsAdd(ImageStats *total, const ImageStats &part)
+{
+    for (int i = 0; i < 256; i++) {
+        total->histogram[i] += part.histogram[i];
     }
-    double averageLum = 0;
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            QColor color = QColor(image_data.pixel(x, y));
-            double lum = 0.299 * color.red() + 0.587 * color.green() + 0.114 * color.blue();
-            // Recompute the average
-            averageLum = (averageLum * (y * x + x) + lum) / (y * x + x + 1);
-        }
+    total->pixels += part.pixels;
+    total->sum += part.sum;
+    total->mean = total->pixels ? total->sum / 65536.0 / total->pixels : 0;
+    total->min = qMin(total->min, part.min);
+    total->max = qMax(total->max, part.max);
+}
+
+const ImageStats &Image::Stats() const
+{
+    if (statsValid) {
+        return stats;
     }
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            QColor color = QColor(image_data.pixel(x, y));
-            // Do a linear transform on each channel based on the difference from the average luminance
-            color.setRed(qBound(0, qRound(averageLum + (color.red() - averageLum) * factor), 255));
-            color.setGreen(qBound(0, qRound(averageLum + (color.green() - averageLum) * factor), 255));
-            color.setBlue(qBound(0, qRound(averageLum + (color.blue() - averageLum) * factor), 255));
-            image_data.setPixel(x, y, color.rgb());
+    memset(&stats, 0, sizeof(stats));
+    stats.min = 255;
+    std::mutex merge;
+    ImageParallelRows(height, [&](int first, int end) {
+        ImageStats band;
+        memset(&band, 0, sizeof(band));
+        for (int y = first; y < end; y++) {
+            const ImagePixel *row = Row(y);
+            for (int x = 0; x < width; x++) {
+                // 0.299, 0.587 and 0.114 in 16.16 fixed point, summing to exactly 1
+                quint32 lum = 19595 * row[x].r + 38470 * row[x].g + 7471 * row[x].b;
+                band.sum += lum;
+                band.histogram[(lum + 32768) >> 16]++;
+            }
         }
-    }
+        band.pixels = (quint64)(end - first) * width;
+        // Integer sums add up the same in any order
+        std::lock_guard<std::mutex> lock(merge);
+        for (int i = 0; i < 256; i++) {
+            stats.histogram[i] += band.histogram[i];
+        }
+        stats.pixels += band.pixels;
+        stats.sum += band.sum;
+    });
+    // The extremes are the first and last occupied levels
+    int min = 0, max = 255;
+    while (min < 256 && !stats.histogram[min]) min++;
+    while (max >= 0 && !stats.histogram[max]) max--;
+    stats.min = min < 256 ? min : 255;
+    stats.max = max >= 0 ? max : 0;
+    stats.mean = stats.pixels ? stats.sum / 65536.0 / stats.pixels : 0;
+    statsValid = true;
+    return stats;
 }
 
 
@@ -147,19 +867,54 @@ void Image::Crop(int top_left_x, int top_left_y, int crop_width, int crop_height
         fputs("Width and height must be nonnegative\n", stderr);
         exit(-1);
     }
-    QImage cropped = QImage(crop_width, crop_height, QImage::Format_RGB32);
-    for (int y = 0; y < crop_height; y++) {
-        for (int x = 0; x < crop_width; x++) {
-            QRgb color = top_left_x + x < 0 || width <= top_left_x + x
-                    || top_left_y + y < 0 || height <= top_left_y + y
-                ? 0
-                : image_data.pixel(top_left_x + x, top_left_y + y);
-            cropped.setPixel(x, y, color);
+    if (top_left_x >= 0 && top_left_y >= 0 && top_left_x + crop_width <= width &&
+        top_left_y + crop_height <= height) {
+        // A view: the same buffer and stride, starting at the window's corner
+        pixels = Row(top_left_y) + top_left_x;
+        width = crop_width;
+        height = crop_height;
+        npixels = width * height;
+        statsValid = false;
+        return;
+    }
+    const ImagePixel black = { 0, 0, 0, 0xff };
+    int new_stride;
+    ImagePixel *cropped = Allocate(crop_width, crop_height, &new_stride);
+    // Columns of the crop window that overlap the image
+    int x0 = qBound(0, -top_left_x, crop_width),
+        x1 = qBound(x0, width - top_left_x, crop_width);
+    ImageParallelRows(crop_height, [&](int first, int end) {
+        for (int y = first; y < end; y++) {
+            ImagePixel *out = cropped + (size_t)y * new_stride;
+            if (top_left_y + y < 0 || height <= top_left_y + y) {
+                for (int x = 0; x < crop_width; x++) out[x] = black;
+                continue;
+            }
+            for (int x = 0; x < x0; x++) out[x] = black;
+            memcpy(out + x0, Row(top_left_y + y) + top_left_x + x0, (x1 - x0) * sizeof(ImagePixel));
+            for (int x = x1; x < crop_width; x++) out[x] = black;
         }
+    });
+    Replace(cropped, crop_width, crop_height, new_stride);
+}
+
+
+void Image::Paste(const Image &source, int x, int y)
+{
+    if (x < 0 || y < 0 || x + source.width > width || y + source.height > height) {
+        fputs("Pasted image must lie inside the image\n", stderr);
+        exit(-1);
+    }
+    if (source.buffer == buffer && source.pixels == Row(y) + x && source.stride == stride) {
+        return;
     }
-    image_data = cropped;
-    width = crop_width;
-    height = crop_height;
+    Detach();
+    ImageParallelRows(source.height, [&](int first, int end) {
+        for (int j = first; j < end; j++) {
+            memcpy(Row(y + j) + x, source.Row(j), source.width * sizeof(ImagePixel));
+        }
+    });
+    PixelsChanged();
 }
 
 
@@ -171,246 +926,1131 @@ void Image::Fun(int sampling_method)
 
 void Image::Gamma(double factor)
 {
-    printf("Must implement Gamma()\n");
+    ImagePointOp op = { IMAGE_OP_GAMMA, factor, 0 };
+    PointOps(&op, 1);
 }
 
 
-void Image::GaussianBlur(double sigma)
+// Below this sigma the recursive filter is inaccurate and direct convolution is cheap
+#define GAUSSIAN_RECURSIVE_MIN_SIGMA 3.0
+
+// Columns filtered together by the vertical recursive pass
+#define GAUSSIAN_COLUMN_BAND 64
+
+// Coefficients of the Young-van Vliet recursive gaussian:
+// w[n] = B x[n] + a1 w[n-1] + a2 w[n-2] + a3 w[n-3], run forwards then backwards
+typedef struct {
+    float B, a1, a2, a3;
+    // Triggs-Sdika matrix giving the backward filter state past the last sample
+    float M[3][3];
+} RecursiveGaussian;
+
+static RecursiveGaussian MakeRecursiveGaussian(double sigma)
 {
-    printf("Must implement GaussianBlur()\n");
+    double q = sigma >= 2.5
+        ? 0.98711 * sigma - 0.96330
+        : 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q,
+           b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q,
+           b2 = -(1.4281 * q * q + 1.26661 * q * q * q),
+           b3 = 0.422205 * q * q * q;
+    double a1 = b1 / b0, a2 = b2 / b0, a3 = b3 / b0;
+    double B = 1 - (a1 + a2 + a3);
+    double k = 1.0 / ((1 + a1 - a2 + a3) * (1 - a1 - a2 - a3) * (1 + a2 + (a1 - a3) * a3));
+    double M[3][3] = {
+        { -a3 * a1 + 1 - a3 * a3 - a2, (a3 + a1) * (a2 + a3 * a1), a3 * (a1 + a3 * a2) },
+        { a1 + a3 * a2, -(a2 - 1) * (a2 + a3 * a1), -(a3 * a1 + a3 * a3 + a2 - 1) * a3 },
+        { a3 * a1 + a2 + a1 * a1 - a2 * a2,
+          a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3,
+          a3 * (a1 + a3 * a2) }
+    };
+    RecursiveGaussian g;
+    g.B = B;
+    g.a1 = a1;
+    g.a2 = a2;
+    g.a3 = a3;
+    // Fold in B, since the backward filter is applied to B-scaled input
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            g.M[i][j] = B * k * M[i][j];
+        }
+    }
+    return g;
 }
 
+/*
+Filters n interleaved signals of length len in place. Sample i of signal c is at
+data[i * n + c]; data must have room for 3 extra samples before and after (so it starts
+3 * n floats before the first sample). The ends are extended by replicating the edges
+*/
+static void RecursiveGaussian1D(const RecursiveGaussian &g, float *data, int len, int n)
+{
+    float *w = data + 3 * n;
+    // Forward pass, starting from the steady state of the first sample
+    for (int c = 0; c < n; c++) {
+        data[c] = data[n + c] = data[2 * n + c] = w[c];
+    }
+    for (int i = 0; i < len; i++) {
+        float *cur = w + i * n;
+        const float *p1 = cur - n, *p2 = cur - 2 * n, *p3 = cur - 3 * n;
+        for (int c = 0; c < n; c++) {
+            cur[c] = g.B * cur[c] + g.a1 * p1[c] + g.a2 * p2[c] + g.a3 * p3[c];
+        }
+    }
+    // Backward pass, starting from the exact state for a replicated right edge. This
+    // needs the unfiltered last sample, which the forward pass overwrote, so it is
+    // recovered from the forward recursion
+    float *last = w + (len - 1) * n;
+    for (int c = 0; c < n; c++) {
+        float u0 = last[c],
+              u1 = len > 1 ? last[c - n] : data[2 * n + c],
+              u2 = len > 2 ? last[c - 2 * n] : data[n + c],
+              u3 = len > 3 ? last[c - 3 * n] : data[c];
+        float edge = (u0 - g.a1 * u1 - g.a2 * u2 - g.a3 * u3) / g.B;
+        float d0 = u0 - edge, d1 = u1 - edge, d2 = u2 - edge;
+        last[c] = edge + g.M[0][0] * d0 + g.M[0][1] * d1 + g.M[0][2] * d2;
+        last[n + c] = edge + g.M[1][0] * d0 + g.M[1][1] * d1 + g.M[1][2] * d2;
+        last[2 * n + c] = edge + g.M[2][0] * d0 + g.M[2][1] * d1 + g.M[2][2] * d2;
+    }
+    for (int i = len - 2; i >= 0; i--) {
+        float *cur = w + i * n;
+        const float *n1 = cur + n, *n2 = cur + 2 * n, *n3 = cur + 3 * n;
+        for (int c = 0; c < n; c++) {
+            cur[c] = g.B * cur[c] + g.a1 * n1[c] + g.a2 * n2[c] + g.a3 * n3[c];
+        }
+    }
+}
 
-void Image::MedianFilter(int filter_width)
+void Image::GaussianBlur(double sigma)
 {
-    printf("Must implement MedianFilter()\n");
+    if (sigma <= 0) {
+        fputs("Blur sigma must be a positive real value\n", stderr);
+        exit(-1);
+    }
+    if (sigma < GAUSSIAN_RECURSIVE_MIN_SIGMA) {
+        GaussianBlurDirect(sigma);
+        return;
+    }
+    RecursiveGaussian g = MakeRecursiveGaussian(sigma);
+    Detach();
+
+    // Vertical pass, in place on bands of columns so rows are read contiguously and
+    // the inner loops run across the band
+    int bands = (width + GAUSSIAN_COLUMN_BAND - 1) / GAUSSIAN_COLUMN_BAND;
+    ImageParallelRows(bands, [&](int first, int end) {
+        float *data = (float *)malloc((size_t)(height + 6) * GAUSSIAN_COLUMN_BAND * 3 * sizeof(float));
+        for (int band = first; band < end; band++) {
+            int x0 = band * GAUSSIAN_COLUMN_BAND;
+            int n = qMin(GAUSSIAN_COLUMN_BAND, width - x0) * 3;
+            for (int y = 0; y < height; y++) {
+                const ImagePixel *row = Row(y) + x0;
+                float *out = data + (size_t)(y + 3) * n;
+                for (int x = 0; x < n / 3; x++) {
+                    out[3 * x] = row[x].r;
+                    out[3 * x + 1] = row[x].g;
+                    out[3 * x + 2] = row[x].b;
+                }
+            }
+            RecursiveGaussian1D(g, data, height, n);
+            for (int y = 0; y < height; y++) {
+                ImagePixel *row = Row(y) + x0;
+                const float *in = data + (size_t)(y + 3) * n;
+                for (int x = 0; x < n / 3; x++) {
+                    row[x].r = ClampFloat(in[3 * x]);
+                    row[x].g = ClampFloat(in[3 * x + 1]);
+                    row[x].b = ClampFloat(in[3 * x + 2]);
+                }
+            }
+        }
+        free(data);
+    });
+
+    // Horizontal pass, in place one row at a time
+    ImageParallelRows(height, [&](int first, int end) {
+        float *data = (float *)malloc((size_t)(width + 6) * 3 * sizeof(float));
+        for (int y = first; y < end; y++) {
+            ImagePixel *row = Row(y);
+            float *samples = data + 9;
+            for (int x = 0; x < width; x++) {
+                samples[3 * x] = row[x].r;
+                samples[3 * x + 1] = row[x].g;
+                samples[3 * x + 2] = row[x].b;
+            }
+            RecursiveGaussian1D(g, data, width, 3);
+            for (int x = 0; x < width; x++) {
+                row[x].r = ClampFloat(samples[3 * x]);
+                row[x].g = ClampFloat(samples[3 * x + 1]);
+                row[x].b = ClampFloat(samples[3 * x + 2]);
+            }
+        }
+        free(data);
+    });
+    PixelsChanged();
 }
 
 
-void Image::MotionBlur(double sigma)
+void Image::GaussianBlurDirect(double sigma)
 {
     if (sigma <= 0) {
-        fputs("Blur factor must be a positive real value\n", stderr);
+        fputs("Blur sigma must be a positive real value\n", stderr);
         exit(-1);
     }
     int radius = qCeil(3 * sigma);
-    double variance2 = sigma * sigma * 2.0;
-    // Use the left half of a one-dimensional Gaussian kernel
-    double *transform = (double *)malloc(radius * sizeof(double));
-    for (int i = 0; i < radius; i++) {
-        double term = radius - 0.5 - i;
-        transform[i] = 2 * exp(-(term * term) / variance2) / sqrt(M_PI * variance2);
+    float *kernel = (float *)malloc((2 * radius + 1) * sizeof(float));
+    double sum = 0;
+    for (int i = -radius; i <= radius; i++) {
+        sum += kernel[i + radius] = exp(-(i * i) / (2 * sigma * sigma));
+    }
+    for (int i = 0; i <= 2 * radius; i++) {
+        kernel[i] /= sum;
     }
-    QImage blurred = QImage(width, height, QImage::Format_RGB32);
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            QColor newColor = QColor(0, 0, 0);
-            for (int i = 0; i < radius; i++) {
-                QColor color = QColor(image_data.pixel(qMax(0, x-radius+i+1), y));
-                newColor.setRed(qRound(newColor.red() + color.red() * transform[i]));
-                newColor.setGreen(qRound(newColor.green() + color.green() * transform[i]));
-                newColor.setBlue(qRound(newColor.blue() + color.blue() * transform[i]));
+    int new_stride;
+    ImagePixel *blurred = Allocate(width, height, &new_stride);
+    ImageParallelRows(height, [&](int first, int end) {
+        // One row blurred vertically, in float so nothing is rounded between the passes
+        float *column = (float *)malloc((size_t)width * 3 * sizeof(float));
+        for (int y = first; y < end; y++) {
+            for (int i = 0; i < width * 3; i++) {
+                column[i] = 0;
+            }
+            for (int i = -radius; i <= radius; i++) {
+                const ImagePixel *row = Row(qBound(0, y + i, height - 1));
+                float k = kernel[i + radius];
+                for (int x = 0; x < width; x++) {
+                    column[3 * x] += k * row[x].r;
+                    column[3 * x + 1] += k * row[x].g;
+                    column[3 * x + 2] += k * row[x].b;
+                }
+            }
+            const ImagePixel *src = Row(y);
+            ImagePixel *out = blurred + (size_t)y * new_stride;
+            for (int x = 0; x < width; x++) {
+                float r = 0, g = 0, b = 0;
+                for (int i = -radius; i <= radius; i++) {
+                    int sx = qBound(0, x + i, width - 1);
+                    float k = kernel[i + radius];
+                    r += k * column[3 * sx];
+                    g += k * column[3 * sx + 1];
+                    b += k * column[3 * sx + 2];
+                }
+                out[x].r = ClampFloat(r);
+                out[x].g = ClampFloat(g);
+                out[x].b = ClampFloat(b);
+                out[x].a = src[x].a;
             }
-            blurred.setPixel(x, y, newColor.rgb());
         }
+        free(column);
+    });
+    free(kernel);
+    Replace(blurred, width, height, new_stride);
+}
+
+
+// Histograms of one image column (or of the whole window) for the red, green and
+// blue channels. Coarse bin k counts the values 16k to 16k + 15, fine bin v counts v
+typedef struct {
+    quint16 coarse[3][16];
+    quint16 fine[3][256];
+} MedianHistogram;
+
+static void MedianHistogramAdd(MedianHistogram *h, const ImagePixel &p, int delta)
+{
+    h->coarse[0][p.r >> 4] += delta;
+    h->coarse[1][p.g >> 4] += delta;
+    h->coarse[2][p.b >> 4] += delta;
+    h->fine[0][p.r] += delta;
+    h->fine[1][p.g] += delta;
+    h->fine[2][p.b] += delta;
+}
+
+void Image::MedianFilter(int filter_width)
+{
+    // Window counts must fit the 16-bit histogram bins
+    if (filter_width <= 0 || filter_width % 2 == 0 || filter_width > 255) {
+        fputs("Median filter width must be a positive odd integer no greater than 255\n", stderr);
+        exit(-1);
     }
-    free(transform);
-    image_data = blurred;
+    // Perreault-Hebert: each band keeps a histogram per column covering the window's
+    // rows, and slides a window histogram along each row by adding the column entering
+    // it and removing the one leaving. Only the 16 coarse bins are slid eagerly; a
+    // window's fine bins for a coarse bin are brought up to date when the median falls
+    // in it. Edges replicate the border pixels
+    const ImageSimdKernels *kernels = ImageSimd();
+    int radius = filter_width / 2;
+    int half = filter_width * filter_width / 2;
+    int new_stride;
+    ImagePixel *filtered = Allocate(width, height, &new_stride);
+    // Every band pays for filling its column histograms, so use as few as possible
+    int bands = qMin(height, ImageThreads());
+    ImageParallelRows(bands, [&](int first, int end) {
+        static const quint16 zero[16] = { 0 };
+        MedianHistogram *columns = (MedianHistogram *)calloc(width, sizeof(MedianHistogram));
+        MedianHistogram window;
+        // Column at which each channel's fine bins of each coarse bin were last valid
+        int updated[3][16];
+        for (int band = first; band < end; band++) {
+            int y0 = (int)((qint64)height * band / bands), y1 = (int)((qint64)height * (band + 1) / bands);
+            memset(columns, 0, width * sizeof(MedianHistogram));
+            for (int i = y0 - radius; i <= y0 + radius; i++) {
+                const ImagePixel *row = Row(qBound(0, i, height - 1));
+                for (int x = 0; x < width; x++) {
+                    MedianHistogramAdd(&columns[x], row[x], 1);
+                }
+            }
+            for (int y = y0; y < y1; y++) {
+                if (y > y0) {
+                    const ImagePixel *leaving = Row(qMax(y - radius - 1, 0));
+                    const ImagePixel *entering = Row(qMin(y + radius, height - 1));
+                    for (int x = 0; x < width; x++) {
+                        MedianHistogramAdd(&columns[x], leaving[x], -1);
+                        MedianHistogramAdd(&columns[x], entering[x], 1);
+                    }
+                }
+                memset(window.coarse, 0, sizeof(window.coarse));
+                for (int i = -radius; i <= radius; i++) {
+                    kernels->Histogram(&window.coarse[0][0], &columns[qBound(0, i, width - 1)].coarse[0][0], zero, 16);
+                    kernels->Histogram(&window.coarse[1][0], &columns[qBound(0, i, width - 1)].coarse[1][0], zero, 16);
+                    kernels->Histogram(&window.coarse[2][0], &columns[qBound(0, i, width - 1)].coarse[2][0], zero, 16);
+                }
+                for (int c = 0; c < 3; c++) {
+                    for (int k = 0; k < 16; k++) {
+                        updated[c][k] = INT_MIN / 2;
+                    }
+                }
+                const ImagePixel *src = Row(y);
+                ImagePixel *out = filtered + (size_t)y * new_stride;
+                for (int x = 0; x < width; x++) {
+                    if (x > 0) {
+                        MedianHistogram *entering = &columns[qMin(x + radius, width - 1)];
+                        MedianHistogram *leaving = &columns[qMax(x - radius - 1, 0)];
+                        if (entering != leaving) {
+                            kernels->Histogram(&window.coarse[0][0], &entering->coarse[0][0], &leaving->coarse[0][0], 48);
+                        }
+                    }
+                    uchar median[3];
+                    for (int c = 0; c < 3; c++) {
+                        int k = 0, count = 0;
+                        while (count + window.coarse[c][k] <= half) {
+                            count += window.coarse[c][k++];
+                        }
+                        quint16 *fine = &window.fine[c][k * 16];
+                        if (x - updated[c][k] > filter_width) {
+                            // Rebuilding is cheaper than catching up
+                            memset(fine, 0, 16 * sizeof(quint16));
+                            for (int i = x - radius; i <= x + radius; i++) {
+                                kernels->Histogram(fine, &columns[qBound(0, i, width - 1)].fine[c][k * 16], zero, 16);
+                            }
+                        }
+                        else {
+                            for (int j = updated[c][k] + 1; j <= x; j++) {
+                                MedianHistogram *entering = &columns[qMin(j + radius, width - 1)];
+                                MedianHistogram *leaving = &columns[qMax(j - radius - 1, 0)];
+                                if (entering != leaving) {
+                                    kernels->Histogram(fine, &entering->fine[c][k * 16], &leaving->fine[c][k * 16], 16);
+                                }
+                            }
+                        }
+                        updated[c][k] = x;
+                        int v = 0;
+                        while (count + fine[v] <= half) {
+                            count += fine[v++];
+                        }
+                        median[c] = k * 16 + v;
+                    }
+                    out[x].r = median[0];
+                    out[x].g = median[1];
+                    out[x].b = median[2];
+                    out[x].a = src[x].a;
+                }
+            }
+        }
+        free(columns);
+    });
+    Replace(filtered, width, height, new_stride);
 }
 
 
-void Image::Nonphotorealism()
+// The pixel of a line of n pixels that tap i reads, or -1 for black, with i reduced first
+// to the int range ImageBorderIndex takes: the border repeats every period when mirrored,
+// and is the same beyond the first pixel past each end otherwise
+static inline int MotionBlurTap(qint64 i, int n, ImageBorder border)
 {
-    printf("Must implement Nonphotorealism()\n");
+    if (border == IMAGE_BORDER_MIRROR && n > 1) {
+        i %= 2 * (qint64)(n - 1);
+    }
+    else {
+        i = qBound<qint64>(-1, i, n);
+    }
+    return ImageBorderIndex((int)i, n, border);
 }
 
+// Box filters the n pixels of line into out over a window of length taps (length >= 1),
+// centered on each pixel, with the pixels beyond its ends following border. sums has room
+// for 3 (n + 1) entries. The window is a running sum whose taps past the ends are looked
+// up rather than stored, so the cost does not depend on length
+static void MotionBlurLine(const ImagePixel *line, ImagePixel *out, int n, double length, ImageBorder border,
+                           quint64 *sums)
+{
+    // Taps within k of the center count fully, the two at k + 1 count edge
+    double half = (length - 1) / 2;
+    qint64 k = (qint64)half;
+    float edge = (float)(half - k), scale = (float)(1 / length);
+    const ImagePixel black = { 0, 0, 0, 0xff };
+    auto tap = [&](qint64 i) -> const ImagePixel & {
+        if (0 <= i && i < n) {
+            return line[i];
+        }
+        int j = MotionBlurTap(i, n, border);
+        return j < 0 ? black : line[j];
+    };
+    qint64 sum[3] = { 0, 0, 0 };
+    if (k < n) {
+        for (qint64 i = -k; i <= k; i++) {
+            const ImagePixel &p = tap(i);
+            sum[0] += p.r;
+            sum[1] += p.g;
+            sum[2] += p.b;
+        }
+    }
+    else {
+        // A window longer than the line: its first sum in closed form, from the prefix sums
+        sums[0] = sums[1] = sums[2] = 0;
+        for (int i = 0; i < n; i++) {
+            sums[3 * i + 3] = sums[3 * i] + line[i].r;
+            sums[3 * i + 4] = sums[3 * i + 1] + line[i].g;
+            sums[3 * i + 5] = sums[3 * i + 2] + line[i].b;
+        }
+        int index[IMAGE_BORDER_SUM_TERMS];
+        quint64 weight[IMAGE_BORDER_SUM_TERMS];
+        int terms = ImageBorderSum(-k, k + 1, n, border, index, weight);
+        for (int c = 0; c < 3; c++) {
+            quint64 total = 0;
+            for (int t = 0; t < terms; t++) {
+                total += weight[t] * sums[3 * index[t] + c];
+            }
+            sum[c] = (qint64)total;
+        }
+    }
+    auto step = [&](int x, const ImagePixel &before, const ImagePixel &after, const ImagePixel &leaving) {
+        out[x].r = ClampFloat((sum[0] + edge * (before.r + after.r)) * scale);
+        out[x].g = ClampFloat((sum[1] + edge * (before.g + after.g)) * scale);
+        out[x].b = ClampFloat((sum[2] + edge * (before.b + after.b)) * scale);
+        out[x].a = line[x].a;
+        // Slide the full-weight window one pixel along
+        sum[0] += after.r - leaving.r;
+        sum[1] += after.g - leaving.g;
+        sum[2] += after.b - leaving.b;
+    };
+    // Only the pixels within k + 1 of the ends have taps past them
+    int first_inside = (int)qMin<qint64>(k + 1, n), end_inside = (int)qMax<qint64>(first_inside, n - k - 1);
+    int x = 0;
+    for (; x < first_inside; x++) {
+        step(x, tap(x - k - 1), tap(x + k + 1), tap(x - k));
+    }
+    for (; x < end_inside; x++) {
+        step(x, line[x - k - 1], line[x + k + 1], line[x - k]);
+    }
+    for (; x < n; x++) {
+        step(x, tap(x - k - 1), tap(x + k + 1), tap(x - k));
+    }
+}
 
-void Image::Rotate(double angle, int sampling_method)
+void Image::MotionBlur(double length, double angle, ImageBorder border, int first_row)
 {
-    if (angle < 0 || 360 < angle) {
-        fputs("Rotation angle must be in the range [0, 360]\n", stderr);
+    if (length <= 0) {
+        fputs("Motion blur length must be a positive real value\n", stderr);
         exit(-1);
     }
-    QImage rotated = QImage(width, height, QImage::Format_RGB32);
-    double dTheta = angle / 180 * M_PI;
-    double cx = (width - 1) / 2,
-           cy = (height - 1) / 2;
-    switch (sampling_method) {
-    case 0: // Point sampling
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                double r = sqrt((x - cx)*(x - cx) + (y - cy)*(y - cy));
-                double theta = atan2(y - cy, x - cx);
-                // Find the nearest pixel rotated -dTheta degrees in the original image
-                int tx = qRound(r * qCos(theta - dTheta) + cx),
-                    ty = qRound(r * qSin(theta - dTheta) + cy);
-                QRgb rgb = tx < 0 || width <= tx || ty < 0 || height <= ty
-                    ? 0 : image_data.pixel(tx, ty);
-                rotated.setPixel(x, y, rgb);
+    // Lines run along the major axis of the motion, one pixel per step, moving
+    // shift[i] pixels across the minor axis by step i. Every line is the first one moved
+    // by a whole number of pixels across, so together they cover each pixel exactly once
+    double radians = angle / 180 * M_PI;
+    double dx = cos(radians), dy = -sin(radians);
+    bool horizontal = qAbs(dx) >= qAbs(dy);
+    int major = horizontal ? width : height, minor = horizontal ? height : width;
+    double slope = horizontal ? dy / dx : dx / dy;
+    // Box length in steps along the major axis
+    double taps = qMax(1.0, length * qMax(qAbs(dx), qAbs(dy)));
+    // Rows are numbered from first_row, so the lines of a strip are those of the whole image
+    int origin = horizontal ? 0 : first_row;
+    int *shift = (int *)malloc(qMax(major, 1) * sizeof(int));
+    for (int i = 0; i < major; i++) {
+        shift[i] = qRound(slope * (i + origin));
+    }
+    int low = major ? qMin(shift[0], shift[major - 1]) : 0, high = major ? qMax(shift[0], shift[major - 1]) : 0;
+    // Line c covers minor coordinates c + shift[i]
+    int first_line = -high, lines = minor + high - low;
+
+    // Lines run diagonally through the image, so their borders are worked out per line
+    // rather than read from the apron
+    int new_stride;
+    ImagePixel *blurred = Allocate(width, height, &new_stride);
+    ImageParallelRows(lines, [&](int first, int end) {
+        ImagePixel *line = (ImagePixel *)malloc(2 * (size_t)qMax(major, 1) * sizeof(ImagePixel));
+        ImagePixel *out = line + major;
+        quint64 *sums = (quint64 *)malloc(3 * ((size_t)major + 1) * sizeof(quint64));
+        size_t *position = (size_t *)malloc(qMax(major, 1) * sizeof(size_t));
+        for (int c = first_line + first; c < first_line + end; c++) {
+            // Gather the part of the line inside the image
+            int n = 0;
+            for (int i = 0; i < major; i++) {
+                int m = c + shift[i];
+                if (m < 0 || minor <= m) {
+                    continue;
+                }
+                int x = horizontal ? i : m, y = horizontal ? m : i;
+                position[n] = (size_t)y * new_stride + x;
+                line[n++] = Row(y)[x];
+            }
+            if (n == 0) {
+                continue;
+            }
+            MotionBlurLine(line, out, n, taps, border, sums);
+            for (int i = 0; i < n; i++) {
+                blurred[position[i]] = out[i];
             }
         }
-        break;
-    case 1: // Bilinear sampling
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                double r = sqrt((x - cx)*(x - cx) + (y - cy)*(y - cy));
-                double theta = atan2(y - cy, x - cx);
-                // Find the nearest pixel rotated -dTheta degrees in the original image
-                double tx = r * qCos(theta - dTheta) + cx,
-                       ty = r * qSin(theta - dTheta) + cy;
-                QColor color = QColor();
-                QColor q11 = QColor(qFloor(tx) < 0 || width <= qFloor(tx) || qFloor(ty) < 0 || height <= qFloor(ty)
-                           ? 0 : image_data.pixel(qFloor(tx), qFloor(ty))),
-                       q12 = QColor(qFloor(tx) < 0 || width <= qFloor(tx) || qCeil(ty) < 0 || height <= qCeil(ty)
-                           ? 0 : image_data.pixel(qFloor(tx), qCeil(ty))),
-                       q21 = QColor(qCeil(tx) < 0 || width <= qCeil(tx) || qFloor(ty) < 0 || height <= qFloor(ty)
-                           ? 0 : image_data.pixel(qCeil(tx),  qFloor(ty))),
-                       q22 = QColor(qCeil(tx) < 0 || width <= qCeil(tx) || qCeil(ty) < 0 || height <= qCeil(ty)
-                           ? 0 : image_data.pixel(qCeil(tx),  qCeil(ty)));
-                // [x2 - x, x - x1]
-                double m1[2] = { qFloor(tx) + 1 - tx, tx - qFloor(tx) };
-                // [y2 - y; y - y1]
-                double m2[2] = { qFloor(ty) + 1 - ty, ty - qFloor(ty) };
-                // https://en.wikipedia.org/wiki/Bilinear_interpolation
-                color.setRed(
-                    m1[0]*(q11.red() * m2[0] + q12.red() * m2[1]) +
-                    m1[1]*(q21.red() * m2[0] + q22.red() * m2[1])
-                );
-                color.setGreen(
-                    m1[0]*(q11.green() * m2[0] + q12.green() * m2[1]) +
-                    m1[1]*(q21.green() * m2[0] + q22.green() * m2[1])
-                );
-                color.setBlue(
-                    m1[0]*(q11.blue() * m2[0] + q12.blue() * m2[1]) +
-                    m1[1]*(q21.blue() * m2[0] + q22.blue() * m2[1])
-                );
-                rotated.setPixel(x, y, color.rgb());
+        free(position);
+        free(sums);
+        free(line);
+    });
+    free(shift);
+    Replace(blurred, width, height, new_stride);
+}
+
+
+// Output pixels per side of a Nonphotorealism tile. A tile and its halo (142 x 142 pixels,
+// 79 KB per buffer) stay in L2 through every stage
+#define NPR_TILE 128
+
+// Smoothing: iterations of a separable bilateral filter, a horizontal and a vertical pass
+// of this radius each, with range weights from the difference in luminance
+#define NPR_RADIUS 3
+#define NPR_ITERATIONS 2
+#define NPR_DOMAIN_SIGMA 2.0
+#define NPR_RANGE_SIGMA 12.0
+
+// Luminance levels of the quantization, and how sharply (per level of luminance) one
+// level steps to the next
+#define NPR_LEVELS 8
+#define NPR_SHARPNESS 0.25
+
+// Sobel magnitudes (|gx| + |gy|, up to 2040) over which edges fade in to black
+#define NPR_EDGE_LOW 80
+#define NPR_EDGE_HIGH 240
+
+#define NPR_SIZE (NPR_TILE + 2 * IMAGE_NONPHOTOREALISM_HALO)
+
+static_assert(IMAGE_NONPHOTOREALISM_HALO == NPR_RADIUS * NPR_ITERATIONS + 1,
+              "The halo covers the smoothing passes and the edge detector");
+
+static void NprLuminances(const ImageSimdKernels *kernels, const ImagePixel *p, uchar *lum,
+                          int x0, int x1, int y0, int y1)
+{
+    for (int y = y0; y < y1; y++) {
+        kernels->Luminance(lum + y * NPR_SIZE + x0, p + y * NPR_SIZE + x0, x1 - x0);
+    }
+}
+
+void Image::Nonphotorealism()
+{
+    // Bilateral weights in 1/256ths, so the center tap weighs exactly 256
+    int *weights = (int *)malloc((NPR_RADIUS + 1) * 256 * sizeof(int));
+    for (int k = 0; k <= NPR_RADIUS; k++) {
+        for (int d = 0; d < 256; d++) {
+            weights[k * 256 + d] = qRound(256 * exp(-(k * k) / (2 * NPR_DOMAIN_SIGMA * NPR_DOMAIN_SIGMA)) *
+                                          exp(-(d * d) / (2 * NPR_RANGE_SIGMA * NPR_RANGE_SIGMA)));
+        }
+    }
+    // Soft quantization (Winnemoller et al., Real-Time Video Abstraction): luminance l
+    // moves to b + step / 2 * tanh(sharpness * (l - b)), b the nearest level boundary
+    int shift[256];
+    double level = 256.0 / NPR_LEVELS;
+    for (int l = 0; l < 256; l++) {
+        double boundary = level * qRound(l / level);
+        shift[l] = qRound(boundary + level / 2 * tanh(NPR_SHARPNESS * (l - boundary))) - l;
+    }
+    // Edge darkening by a smoothstep of the Sobel magnitude
+    uchar edge[2041];
+    for (int m = 0; m <= 2040; m++) {
+        double t = qBound(0.0, (m - NPR_EDGE_LOW) / (double)(NPR_EDGE_HIGH - NPR_EDGE_LOW), 1.0);
+        edge[m] = (uchar)qRound(255 * (1 - t * t * (3 - 2 * t)));
+    }
+
+    const ImageSimdKernels *kernels = ImageSimd();
+    const int halo = IMAGE_NONPHOTOREALISM_HALO;
+    const int tiles_x = (width + NPR_TILE - 1) / NPR_TILE, tiles_y = (height + NPR_TILE - 1) / NPR_TILE;
+    int new_stride;
+    ImagePixel *result = Allocate(width, height, &new_stride);
+    ImageParallelRows(tiles_x * tiles_y, [&](int first, int end) {
+        const int cells = NPR_SIZE * NPR_SIZE;
+        ImagePixel *a = (ImagePixel *)malloc(2 * cells * sizeof(ImagePixel)), *b = a + cells;
+        uchar *lum = (uchar *)malloc(cells);
+        int fade[NPR_TILE], delta[NPR_TILE];
+        for (int t = first; t < end; t++) {
+            int ox = (t % tiles_x) * NPR_TILE, oy = (t / tiles_x) * NPR_TILE;
+            // The tile and its halo, with the image's edge pixels repeated beyond it. Every
+            // stage works on the region still valid after the one before
+            bool inside = ox >= halo && ox - halo + NPR_SIZE <= width;
+            for (int y = 0; y < NPR_SIZE; y++) {
+                const ImagePixel *row = Row(qBound(0, oy - halo + y, height - 1));
+                if (inside) {
+                    memcpy(a + y * NPR_SIZE, row + ox - halo, NPR_SIZE * sizeof(ImagePixel));
+                    continue;
+                }
+                for (int x = 0; x < NPR_SIZE; x++) {
+                    a[y * NPR_SIZE + x] = row[qBound(0, ox - halo + x, width - 1)];
+                }
+            }
+            int x0 = 0, x1 = NPR_SIZE, y0 = 0, y1 = NPR_SIZE;
+            for (int i = 0; i < NPR_ITERATIONS; i++) {
+                NprLuminances(kernels, a, lum, x0, x1, y0, y1);
+                x0 += NPR_RADIUS, x1 -= NPR_RADIUS;
+                for (int y = y0; y < y1; y++) {
+                    int j = y * NPR_SIZE + x0;
+                    kernels->Bilateral(b + j, a + j, lum + j, x1 - x0, 1, NPR_RADIUS, weights);
+                }
+                NprLuminances(kernels, b, lum, x0, x1, y0, y1);
+                y0 += NPR_RADIUS, y1 -= NPR_RADIUS;
+                for (int y = y0; y < y1; y++) {
+                    int j = y * NPR_SIZE + x0;
+                    kernels->Bilateral(a + j, b + j, lum + j, x1 - x0, NPR_SIZE, NPR_RADIUS, weights);
+                }
+            }
+            NprLuminances(kernels, a, lum, x0, x1, y0, y1);
+
+            // Quantize and darken the edges of the tile's own pixels
+            int nx = qMin(NPR_TILE, width - ox), ny = qMin(NPR_TILE, height - oy);
+            for (int y = 0; y < ny; y++) {
+                const uchar *l = lum + (y + halo) * NPR_SIZE + halo;
+                const uchar *up = l - NPR_SIZE, *down = l + NPR_SIZE;
+                for (int x = 0; x < nx; x++) {
+                    int gx = (up[x + 1] + 2 * l[x + 1] + down[x + 1]) - (up[x - 1] + 2 * l[x - 1] + down[x - 1]);
+                    int gy = (down[x - 1] + 2 * down[x] + down[x + 1]) - (up[x - 1] + 2 * up[x] + up[x + 1]);
+                    fade[x] = edge[qAbs(gx) + qAbs(gy)];
+                    delta[x] = shift[l[x]];
+                }
+                const ImagePixel *p = a + (y + halo) * NPR_SIZE + halo;
+                ImagePixel *out = result + (size_t)(oy + y) * new_stride + ox;
+                for (int x = 0; x < nx; x++) {
+                    int f = fade[x], d = delta[x];
+                    out[x].r = (qBound(0, p[x].r + d, 255) * f + 127) / 255;
+                    out[x].g = (qBound(0, p[x].g + d, 255) * f + 127) / 255;
+                    out[x].b = (qBound(0, p[x].b + d, 255) * f + 127) / 255;
+                    out[x].a = p[x].a;
+                }
             }
         }
+        free(lum);
+        free(a);
+    });
+    free(weights);
+    Replace(result, width, height, new_stride);
+}
+
+
+static void TableSpan(ImagePixel *p, int n, const uchar *table)
+{
+    for (int x = 0; x < n; x++) {
+        p[x].r = table[p[x].r];
+        p[x].g = table[p[x].g];
+        p[x].b = table[p[x].b];
+    }
+}
+
+
+// Validates op and precomputes its per-call state; exits on invalid arguments
+static void PreparePointOp(const ImagePointOp &op, PreparedPointOp *prepared)
+{
+    prepared->type = op.type;
+    switch (op.type) {
+    case IMAGE_OP_BRIGHTNESS:
+        if (op.factor < 0 || 2 < op.factor) {
+            fputs("Brightness alpha factor must be in the range [0.0, 2.0]\n", stderr);
+            exit(-1);
+        }
+        prepared->factor = qRound(op.factor * 65536);
         break;
-    case 2: // Gaussian sampling
-        fputs("Must implement Gaussian sampling\n", stderr);
+    case IMAGE_OP_CHANNEL_EXTRACT: {
+        if (op.channel < 0 || op.channel >= IMAGE_NUM_CHANNELS) {
+            fputs("Channel must be one of 0=red, 1=green, 2=blue, 3=alpha\n", stderr);
+            exit(-1);
+        }
+        // Create a mask for each pixel depending on the channel number.
+        // ImagePixel channels are stored in the same order as ImageChannel
+        ImagePixel maskPixel = { 0, 0, 0, 0xff };
+        ((uchar *)&maskPixel)[op.channel] = 0xff;
+        memcpy(&prepared->mask, &maskPixel, sizeof(prepared->mask));
+        break;
+    }
+    case IMAGE_OP_CONTRAST:
+        if (op.factor < -1 || 2 < op.factor) {
+            fputs("Contrast alpha factor must be in the range [-1.0, 2.0]\n", stderr);
+            exit(-1);
+        }
+        prepared->factor = qRound(op.factor * 4096);
+        break;
+    case IMAGE_OP_GAMMA:
+        if (op.factor <= 0) {
+            fputs("Gamma exponent must be a positive real value\n", stderr);
+            exit(-1);
+        }
+        // Only 256 possible inputs, so evaluate pow() once for each of them
+        for (int v = 0; v < 256; v++) {
+            prepared->table[v] = qRound(255 * pow(v / 255.0, 1 / op.factor));
+        }
+        break;
+    case IMAGE_OP_SATURATION:
+        if (op.factor < -1 || 2.5 < op.factor) {
+            fputs("Saturation factor must be in the range [-1.0, 2.5]\n", stderr);
+            exit(-1);
+        }
+        prepared->factor = qRound(op.factor * 4096);
         break;
     default:
-        fputs("Sampling method must be one of 0=point [default], 1=bilinear, 2=gaussian\n", stderr);
+        fputs("Unknown point operation\n", stderr);
         exit(-1);
     }
-    image_data = rotated;
-    width = rotated.width();
-    height = rotated.height();
 }
 
 
-void Image::Saturation(double factor)
+void Image::PointOps(const ImagePointOp *ops, int count)
 {
-    if (factor < -1 || 2.5 < factor) {
-        fputs("Saturation factor must be in the range [-1.0, 2.5]\n", stderr);
-        exit(-1);
+    const ImageSimdKernels *kernels = ImageSimd();
+    // Validate every operation before touching any pixels
+    PreparedPointOp *prepared = new PreparedPointOp[count];
+    for (int i = 0; i < count; i++) {
+        PreparePointOp(ops[i], &prepared[i]);
     }
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            QColor color = QColor(image_data.pixel(x, y));
-            double lum = 0.299 * color.red() + 0.587 * color.green() + 0.114 * color.blue();
-            color.setRed(qBound(0, qRound(lum + (color.red() - lum) * factor), 255));
-            color.setGreen(qBound(0, qRound(lum + (color.green() - lum) * factor), 255));
-            color.setBlue(qBound(0, qRound(lum + (color.blue() - lum) * factor), 255));
-            image_data.setPixel(x, y, color.rgb());
+
+    PointStage *stages = new PointStage[count];
+    int nstages = 0;
+    auto run = [&]() {
+        for (int i = 0; i < nstages; i++) {
+            if (!stages[i].saturation) {
+                for (int c = 0; c < 4; c++) {
+                    for (int v = 0; v < 256; v++) {
+                        ImagePixel entry = { 0, 0, 0, 0 };
+                        (&entry.r)[c] = (&stages[i].ramp[v].r)[c];
+                        memcpy(&stages[i].table[c * 256 + v], &entry, sizeof(quint32));
+                    }
+                }
+            }
+        }
+        Detach();
+        ImageParallelRows(height, [&](int first, int end) {
+            for (int y = first; y < end; y++) {
+                ImagePixel *row = Row(y);
+                for (int x = 0; x < width; x += IMAGE_TILE_PIXELS) {
+                    ImagePixel *tile = row + x;
+                    int n = qMin(IMAGE_TILE_PIXELS, width - x);
+                    for (int i = 0; i < nstages; i++) {
+                        if (stages[i].saturation) {
+                            kernels->Mix(tile, n, stages[i].saturation->factor, -1);
+                        }
+                        else {
+                            kernels->Lut(tile, n, stages[i].table);
+                        }
+                    }
+                }
+            }
+        });
+        nstages = 0;
+        PixelsChanged();
+    };
+
+    for (int i = 0; i < count; i++) {
+        if (prepared[i].type == IMAGE_OP_SATURATION) {
+            stages[nstages++].saturation = &prepared[i];
+            continue;
+        }
+        // Contrast around the image's own average needs the pixels as they are here
+        bool average = prepared[i].type == IMAGE_OP_CONTRAST && ops[i].average < 0;
+        if (average && nstages > 0) {
+            run();
         }
+        if (nstages == 0 || stages[nstages - 1].saturation) {
+            PointStage *stage = &stages[nstages++];
+            stage->saturation = NULL;
+            for (int v = 0; v < 256; v++) {
+                ImagePixel identity = { (uchar)v, (uchar)v, (uchar)v, (uchar)v };
+                stage->ramp[v] = identity;
+            }
+        }
+        // Each channel's table is the operation's own kernel applied to the values the
+        // table produces so far, so the tables give exactly the kernels' results
+        ImagePixel *ramp = stages[nstages - 1].ramp;
+        switch (prepared[i].type) {
+        case IMAGE_OP_BRIGHTNESS:
+            kernels->Scale(ramp, 256, prepared[i].factor);
+            break;
+        case IMAGE_OP_CHANNEL_EXTRACT:
+            kernels->Mask(ramp, 256, prepared[i].mask);
+            break;
+        case IMAGE_OP_CONTRAST:
+            kernels->Mix(ramp, 256, prepared[i].factor,
+                         qRound((average ? Stats().mean : ops[i].average) * 256));
+            break;
+        case IMAGE_OP_GAMMA:
+            TableSpan(ramp, 256, prepared[i].table);
+            break;
+        default:
+            break;
+        }
+    }
+    if (nstages > 0) {
+        run();
+    }
+    delete[] stages;
+    delete[] prepared;
+}
+
+
+void Image::Rotate(double angle, int sampling_method, ImageBorder border)
+{
+    if (angle < 0 || 360 < angle) {
+        fputs("Rotation angle must be in the range [0, 360]\n", stderr);
+        exit(-1);
     }
+    double dTheta = angle / 180 * M_PI;
+    double c = cos(dTheta), s = sin(dTheta);
+    double cx = (width - 1) / 2,
+           cy = (height - 1) / 2;
+    // Each output pixel samples the pixel rotated -dTheta around the center
+    const double matrix[6] = {
+        c, s, cx - c * cx - s * cy,
+        -s, c, cy + s * cx - c * cy
+    };
+    Warp(matrix, width, height, sampling_method, border);
 }
 
 
-void Image::Scale(double sx, double sy, int sampling_method)
+void Image::Saturation(double factor)
+{
+    ImagePointOp op = { IMAGE_OP_SATURATION, factor, 0 };
+    PointOps(&op, 1);
+}
+
+
+void Image::Scale(double sx, double sy, int sampling_method, ImageBorder border)
 {
     if (sx < 0.05 || 20 < sx || sy < 0.05 || 20 < sy) {
         fputs("Scaling factors must be in the range [0.05, 20]\n", stderr);
         exit(-1);
     }
-    QImage resized = QImage(qRound(sx * width), qRound(sy * height), QImage::Format_RGB32);
-    switch (sampling_method) {
-    case 0: // Point sampling
-        for (int y = 0; y < resized.height(); y++) {
-            for (int x = 0; x < resized.width(); x++) {
-                QRgb rgb = image_data.pixel(qMin(qRound(x / sx), width-1), qMin(qRound(y / sy), height-1));
-                resized.setPixel(x, y, rgb);
-            }
+    if (sampling_method == IMAGE_GAUSSIAN_SAMPLING || sampling_method == IMAGE_LANCZOS_SAMPLING) {
+        Resample(qRound(sx * width), qRound(sy * height), sampling_method, border);
+        return;
+    }
+    if (sampling_method == IMAGE_AREA_SAMPLING) {
+        ResampleArea(qRound(sx * width), qRound(sy * height));
+        return;
+    }
+    const double matrix[6] = {
+        1 / sx, 0, 0,
+        0, 1 / sy, 0
+    };
+    Warp(matrix, qRound(sx * width), qRound(sy * height), sampling_method, border);
+}
+
+
+// Filter weights are fixed-point with this many fraction bits
+#define FILTER_BITS 14
+
+// Subpixel positions a filter bank has weights for
+#define FILTER_PHASES 64
+
+// A resampling filter tabulated at FILTER_PHASES subpixel offsets. Sampling at source
+// coordinate c reads taps pixels starting at floor(c) - taps / 2 + 1, weighted by the
+// row of the phase nearest to c - floor(c). Every row sums to exactly 1 << FILTER_BITS
+typedef struct {
+    int taps;
+    qint16 *weights;
+} FilterBank;
+
+static double FilterKernel(int sampling_method, double t)
+{
+    if (sampling_method == IMAGE_LANCZOS_SAMPLING) {
+        // Lanczos with 3 lobes
+        if (t == 0) {
+            return 1;
         }
-        break;
-    case 1: // Bilinear sampling
-        for (int y = 0; y < resized.height(); y++) {
-            for (int x = 0; x < resized.width(); x++) {
-                QColor color = QColor();
-                QColor q11 = QColor(image_data.pixel(qFloor(x / sx),               qFloor(y / sy))),
-                       q12 = QColor(image_data.pixel(qFloor(x / sx),               qMin(qCeil(y / sy), height-1))),
-                       q21 = QColor(image_data.pixel(qMin(qCeil(x / sx), width-1), qFloor(y / sy))),
-                       q22 = QColor(image_data.pixel(qMin(qCeil(x / sx), width-1), qMin(qCeil(y / sy), height-1)));
-                // [x2 - x, x - x1]
-                double m1[2] = { qFloor(x / sx) + 1 - x / sx, x / sx - qFloor(x / sx) };
-                // [y2 - y; y - y1]
-                double m2[2] = { qFloor(y / sy) + 1 - y / sy, y / sy - qFloor(y / sy) };
-                // https://en.wikipedia.org/wiki/Bilinear_interpolation
-                color.setRed(
-                    m1[0]*(q11.red() * m2[0] + q12.red() * m2[1]) +
-                    m1[1]*(q21.red() * m2[0] + q22.red() * m2[1])
-                );
-                color.setGreen(
-                    m1[0]*(q11.green() * m2[0] + q12.green() * m2[1]) +
-                    m1[1]*(q21.green() * m2[0] + q22.green() * m2[1])
-                );
-                color.setBlue(
-                    m1[0]*(q11.blue() * m2[0] + q12.blue() * m2[1]) +
-                    m1[1]*(q21.blue() * m2[0] + q22.blue() * m2[1])
-                );
-                resized.setPixel(x, y, color.rgb());
-            }
+        if (qAbs(t) >= 3) {
+            return 0;
         }
-        break;
-    case 2: // Gaussian sampling
-        fputs("Must implement Gaussian sampling\n", stderr);
+        return 3 * sin(M_PI * t) * sin(M_PI * t / 3) / (M_PI * M_PI * t * t);
+    }
+    // Gaussian with a sigma of half a pixel
+    return exp(-2 * t * t);
+}
+
+/*
+Tabulates the gaussian or lanczos filter stretched by scale source pixels per output
+pixel. Stretching makes downscaling average over every source pixel it covers
+*/
+static FilterBank MakeFilterBank(int sampling_method, double scale)
+{
+    double support = sampling_method == IMAGE_LANCZOS_SAMPLING ? 3 : 1.5;
+    FilterBank bank;
+    int half = qCeil(support * scale);
+    bank.taps = 2 * half;
+    bank.weights = (qint16 *)malloc((FILTER_PHASES + 1) * bank.taps * sizeof(qint16));
+    double *w = (double *)malloc(bank.taps * sizeof(double));
+    for (int phase = 0; phase <= FILTER_PHASES; phase++) {
+        double offset = (double)phase / FILTER_PHASES;
+        double sum = 0;
+        for (int k = 0; k < bank.taps; k++) {
+            sum += w[k] = FilterKernel(sampling_method, (k - half + 1 - offset) / scale);
+        }
+        // Round the running total so rounding errors do not accumulate
+        qint16 *row = bank.weights + phase * bank.taps;
+        double total = 0;
+        int assigned = 0;
+        for (int k = 0; k < bank.taps; k++) {
+            total += w[k] / sum;
+            int next = qRound(total * (1 << FILTER_BITS));
+            row[k] = next - assigned;
+            assigned = next;
+        }
+    }
+    free(w);
+    return bank;
+}
+
+// Returns the weights for sampling at c, and the first source pixel they apply to
+static inline const qint16 *FilterPhase(const FilterBank &bank, double c, int *first)
+{
+    int base = qFloor(c);
+    // Phase FILTER_PHASES is offset 1, kept so rounding up needs no special case
+    int phase = qRound((c - base) * FILTER_PHASES);
+    *first = base - bank.taps / 2 + 1;
+    return bank.weights + phase * bank.taps;
+}
+
+struct SharpenKernel {
+    enum { size = 3, shift = 0, opaque = 1 }; // alpha stays 255, as it always has for Sharpen
+    static constexpr int Weight(int y, int x) { return y == 1 && x == 1 ? 9 : -1; }
+};
+
+void Image::Sharpen(ImageBorder border)
+{
+    Convolve<SharpenKernel>(border);
+}
+
+
+void Image::Warp(const double *matrix, int new_width, int new_height, int sampling_method, ImageBorder border)
+{
+    switch (sampling_method) {
+    case IMAGE_POINT_SAMPLING:
+    case IMAGE_BILINEAR_SAMPLING:
+    case IMAGE_GAUSSIAN_SAMPLING:
+    case IMAGE_LANCZOS_SAMPLING:
         break;
     default:
-        fputs("Sampling method must be one of 0=point [default], 1=bilinear, 2=gaussian\n", stderr);
+        fputs("Sampling method must be one of 0=point [default], 1=bilinear, 2=gaussian, 3=lanczos "
+              "(4=area only scales)\n", stderr);
         exit(-1);
     }
-    image_data = resized;
-    width = resized.width();
-    height = resized.height();
-}
-
-
-void Image::Sharpen()
-{
-    QImage sharpened = QImage(width, height, QImage::Format_RGB32);
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            QColor color = QColor();
-            // Get pixels used by the kernel
-            QColor q11 = QColor(image_data.pixel(qMax(0, x-1),       qMax(0, y-1))),
-                   q12 = QColor(image_data.pixel(qMax(0, x-1),       y)),
-                   q13 = QColor(image_data.pixel(qMax(0, x-1),       qMin(y+1, height-1))),
-                   q21 = QColor(image_data.pixel(x,                  qMax(0, y-1))),
-                   q22 = QColor(image_data.pixel(x,                  y)),
-                   q23 = QColor(image_data.pixel(x,                  qMin(y+1, height-1))),
-                   q31 = QColor(image_data.pixel(qMin(x+1, width-1), qMax(0, y-1))),
-                   q32 = QColor(image_data.pixel(qMin(x+1, width-1), y)),
-                   q33 = QColor(image_data.pixel(qMin(x+1, width-1), qMin(y+1, height-1)));
-            color.setRed(qBound(0,
-                -1 * q11.red() + -1 * q12.red() + -1 * q13.red() +
-                -1 * q21.red() +  9 * q22.red() + -1 * q23.red() +
-                -1 * q31.red() + -1 * q32.red() + -1 * q33.red(),
-            255));
-            color.setGreen(qBound(0,
-                -1 * q11.green() + -1 * q12.green() + -1 * q13.green() +
-                -1 * q21.green() +  9 * q22.green() + -1 * q23.green() +
-                -1 * q31.green() + -1 * q32.green() + -1 * q33.green(),
-            255));
-            color.setBlue(qBound(0,
-                -1 * q11.blue() + -1 * q12.blue() + -1 * q13.blue() +
-                -1 * q21.blue() +  9 * q22.blue() + -1 * q23.blue() +
-                -1 * q31.blue() + -1 * q32.blue() + -1 * q33.blue(),
-            255));
-            sharpened.setPixel(x, y, color.rgb());
-        }
-    }
-    image_data = sharpened;
+    const ImageSimdKernels *kernels = ImageSimd();
+    // Coordinates outside the image are clamped into the one pixel apron (or mirrored)
+    FillApron(1, border);
+    const ImageWarpSource src = { pixels, stride, width, height, border };
+    // Filters widen by how far apart neighboring output pixels land in the source
+    FilterBank bank = { 0, NULL };
+    if (sampling_method >= IMAGE_GAUSSIAN_SAMPLING) {
+        double spread = qMax(sqrt(matrix[0] * matrix[0] + matrix[3] * matrix[3]),
+                             sqrt(matrix[1] * matrix[1] + matrix[4] * matrix[4]));
+        bank = MakeFilterBank(sampling_method, qMax(spread, 1.0));
+    }
+    int new_stride;
+    ImagePixel *warped = Allocate(new_width, new_height, &new_stride);
+    ImageParallelRows(new_height, [&](int first, int end) {
+        for (int y = first; y < end; y++) {
+            ImagePixel *out = warped + (size_t)y * new_stride;
+            // Along a row the source position moves by the matrix's first column, so only
+            // the start of each row is transformed
+            double x0 = matrix[1] * y + matrix[2], y0 = matrix[4] * y + matrix[5];
+            if (sampling_method < IMAGE_GAUSSIAN_SAMPLING) {
+                kernels->Warp(out, new_width, &src, x0, y0, matrix[0], matrix[3],
+                              sampling_method == IMAGE_BILINEAR_SAMPLING);
+                continue;
+            }
+            for (int x = 0; x < new_width; x++) {
+                int ix, iy;
+                const qint16 *wx = FilterPhase(bank, x0 + x * matrix[0], &ix),
+                             *wy = FilterPhase(bank, y0 + x * matrix[3], &iy);
+                qint64 sum[4] = { 0, 0, 0, 0 };
+                for (int ky = 0; ky < bank.taps; ky++) {
+                    int row[4] = { 0, 0, 0, 0 };
+                    for (int kx = 0; kx < bank.taps; kx++) {
+                        ImagePixel p = Row(ImageWarpCoordinate(iy + ky, height, border))[
+                            ImageWarpCoordinate(ix + kx, width, border)];
+                        row[0] += wx[kx] * p.r;
+                        row[1] += wx[kx] * p.g;
+                        row[2] += wx[kx] * p.b;
+                        row[3] += wx[kx] * p.a;
+                    }
+                    for (int c = 0; c < 4; c++) {
+                        sum[c] += (qint64)wy[ky] * row[c];
+                    }
+                }
+                uchar *result = &out[x].r;
+                for (int c = 0; c < 4; c++) {
+                    result[c] = qBound<qint64>(0, (sum[c] + (1 << (2 * FILTER_BITS - 1))) >> (2 * FILTER_BITS), 255);
+                }
+            }
+        }
+    });
+    free(bank.weights);
+    Replace(warped, new_width, new_height, new_stride);
+}
+
+
+void Image::Resample(int new_width, int new_height, int sampling_method, ImageBorder border)
+{
+    if (new_width == 0 || new_height == 0) {
+        int new_stride;
+        ImagePixel *resized = Allocate(new_width, new_height, &new_stride);
+        Replace(resized, new_width, new_height, new_stride);
+        return;
+    }
+    // Output pixel i is centered on source coordinate (i + 0.5) * scale - 0.5
+    double scaleX = (double)width / new_width, scaleY = (double)height / new_height;
+    FilterBank bankX = MakeFilterBank(sampling_method, qMax(scaleX, 1.0)),
+               bankY = MakeFilterBank(sampling_method, qMax(scaleY, 1.0));
+    // Where each output column and row starts reading, and its weights
+    int *firstX = (int *)malloc(new_width * sizeof(int)), *firstY = (int *)malloc(new_height * sizeof(int));
+    const qint16 **weightsX = (const qint16 **)malloc(new_width * sizeof(qint16 *)),
+                 **weightsY = (const qint16 **)malloc(new_height * sizeof(qint16 *));
+    for (int x = 0; x < new_width; x++) {
+        weightsX[x] = FilterPhase(bankX, (x + 0.5) * scaleX - 0.5, &firstX[x]);
+    }
+    for (int y = 0; y < new_height; y++) {
+        weightsY[y] = FilterPhase(bankY, (y + 0.5) * scaleY - 0.5, &firstY[y]);
+    }
+    // How far the taps reach past the edges, which the apron covers. The starts only
+    // grow, so the first and last reach furthest
+    int reachX = qMax(-firstX[0], firstX[new_width - 1] + bankX.taps - width),
+        reachY = qMax(-firstY[0], firstY[new_height - 1] + bankY.taps - height);
+    reachX = qMax(reachX, 0);
+    reachY = qMax(reachY, 0);
+    FillApron(qMax(reachX, reachY), border);
+
+    // Horizontal pass into an intermediate new_width x height image, with reachY rows of
+    // apron: the horizontal pass of the source's apron rows is the same extension of the
+    // intermediate image, so the vertical pass reads past the edges too
+    int mid_apron = (reachY + IMAGE_APRON - 1) / IMAGE_APRON * IMAGE_APRON, mid_stride;
+    ImagePixel *mid = Allocate(new_width, height, &mid_stride, mid_apron);
+    ImageParallelRows(height + 2 * reachY, [&](int first, int end) {
+        for (int y = first - reachY; y < end - reachY; y++) {
+            const ImagePixel *row = Row(y);
+            ImagePixel *out = mid + (ptrdiff_t)y * mid_stride;
+            for (int x = 0; x < new_width; x++) {
+                const qint16 *w = weightsX[x];
+                const ImagePixel *p = row + firstX[x];
+                int sum[4] = { 1 << (FILTER_BITS - 1), 1 << (FILTER_BITS - 1),
+                               1 << (FILTER_BITS - 1), 1 << (FILTER_BITS - 1) };
+                for (int k = 0; k < bankX.taps; k++) {
+                    sum[0] += w[k] * p[k].r;
+                    sum[1] += w[k] * p[k].g;
+                    sum[2] += w[k] * p[k].b;
+                    sum[3] += w[k] * p[k].a;
+                }
+                out[x].r = qBound(0, sum[0] >> FILTER_BITS, 255);
+                out[x].g = qBound(0, sum[1] >> FILTER_BITS, 255);
+                out[x].b = qBound(0, sum[2] >> FILTER_BITS, 255);
+                out[x].a = qBound(0, sum[3] >> FILTER_BITS, 255);
+            }
+        }
+    });
+
+    // Vertical pass, accumulating whole rows so the inner loop runs along memory
+    int new_stride;
+    ImagePixel *resized = Allocate(new_width, new_height, &new_stride);
+    ImageParallelRows(new_height, [&](int first, int end) {
+        int *sum = (int *)malloc(new_width * 4 * sizeof(int));
+        for (int y = first; y < end; y++) {
+            const qint16 *w = weightsY[y];
+            for (int i = 0; i < new_width * 4; i++) {
+                sum[i] = 1 << (FILTER_BITS - 1);
+            }
+            for (int k = 0; k < bankY.taps; k++) {
+                const uchar *row = &mid[(ptrdiff_t)(firstY[y] + k) * mid_stride].r;
+                for (int i = 0; i < new_width * 4; i++) {
+                    sum[i] += w[k] * row[i];
+                }
+            }
+            uchar *out = &resized[(size_t)y * new_stride].r;
+            for (int i = 0; i < new_width * 4; i++) {
+                out[i] = qBound(0, sum[i] >> FILTER_BITS, 255);
+            }
+        }
+        free(sum);
+    });
+
+    Free(mid, mid_stride, mid_apron);
+    free(firstX);
+    free(firstY);
+    free(weightsX);
+    free(weightsY);
+    free(bankX.weights);
+    free(bankY.weights);
+    Replace(resized, new_width, new_height, new_stride);
 }
+
+
+void Image::ResampleArea(int new_width, int new_height)
+{
+    int new_stride;
+    ImagePixel *resized = Allocate(new_width, new_height, &new_stride);
+    if (new_width == 0 || new_height == 0) {
+        Replace(resized, new_width, new_height, new_stride);
+        return;
+    }
+    // Output pixel (x, y) covers source [x scaleX, (x + 1) scaleX) x [y scaleY, (y + 1) scaleY)
+    double scaleX = (double)width / new_width, scaleY = (double)height / new_height;
+    const double scale = 1 / (scaleX * scaleY);
+    ImageIntegral integral(*this);
+    // Footprint edge i lies fraction[i] of the way from table column column[i] to the next
+    int *column = (int *)malloc((new_width + 1) * sizeof(int));
+    double *fraction = (double *)malloc((new_width + 1) * sizeof(double));
+    for (int i = 0; i <= new_width; i++) {
+        double x = qMin(i * scaleX, (double)width);
+        column[i] = qMin((int)x, width - 1);
+        fraction[i] = x - column[i];
+    }
+    ImageParallelRows(new_height, [&](int first, int end) {
+        // The table interpolated at every footprint edge along footprint edge j
+        auto interpolate = [&](int j, double *sums) {
+            double y = qMin(j * scaleY, (double)height);
+            int row = qMin((int)y, height - 1);
+            double fy = y - row;
+            const quint64 *top = integral.Row(row), *bottom = integral.Row(row + 1);
+            for (int i = 0; i <= new_width; i++) {
+                const quint64 *t = top + 4 * column[i], *b = bottom + 4 * column[i];
+                double fx = fraction[i];
+                for (int c = 0; c < 4; c++) {
+                    double upper = (qint64)t[c] + fx * (qint64)(t[c + 4] - t[c]);
+                    double lower = (qint64)b[c] + fx * (qint64)(b[c + 4] - b[c]);
+                    sums[4 * i + c] = upper + fy * (lower - upper);
+                }
+            }
+        };
+        double *sums = (double *)malloc(8 * (new_width + 1) * sizeof(double));
+        double *above = sums, *below = sums + 4 * (new_width + 1);
+        interpolate(first, above);
+        for (int y = first; y < end; y++) {
+            interpolate(y + 1, below);
+            uchar *out = &resized[(size_t)y * new_stride].r;
+            for (int i = 0; i < 4 * new_width; i++) {
+                double v = (below[i + 4] - below[i] - above[i + 4] + above[i]) * scale;
+                out[i] = (uchar)qBound(0.0, v + 0.5, 255.0);
+            }
+            qSwap(above, below);
+        }
+        free(sums);
+    });
+    free(column);
+    free(fraction);
+    Replace(resized, new_width, new_height, new_stride);
+}
\ No newline at end of file
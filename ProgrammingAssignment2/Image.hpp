@@ -11,10 +11,51 @@
 typedef enum {
     IMAGE_POINT_SAMPLING,
     IMAGE_BILINEAR_SAMPLING,
-    IMAGE_GAUSSIAN_SAMPLING
+    IMAGE_GAUSSIAN_SAMPLING,
+    IMAGE_LANCZOS_SAMPLING,
+    IMAGE_AREA_SAMPLING // Scale only
 } ImageSamplingMethod;
 
 
+typedef enum {
+    IMAGE_FORMAT_JPG,
+    IMAGE_FORMAT_PPM, // binary RGB, 8 bits per channel
+    IMAGE_FORMAT_PAM, // binary RGBA, 8 bits per channel
+    IMAGE_FORMAT_PFM  // RGB floats, 0 to 1
+} ImageFileFormat;
+
+
+/*
+What a neighborhood operator reads beyond the image's edges
+*/
+typedef enum {
+    IMAGE_BORDER_CLAMP, // the nearest edge pixel
+    IMAGE_BORDER_MIRROR, // the image reflected about its edge pixels: -1 reads 1, width reads width - 2
+    IMAGE_BORDER_ZERO // opaque black, the fill of Rotate and Crop
+} ImageBorder;
+
+/*
+Where coordinate i of a row or column of n pixels (n > 0) reads from under border, or -1
+for IMAGE_BORDER_ZERO outside the image
+*/
+static inline int ImageBorderIndex(int i, int n, ImageBorder border)
+{
+    if (0 <= i && i < n) {
+        return i;
+    }
+    if (border == IMAGE_BORDER_ZERO) {
+        return -1;
+    }
+    if (border == IMAGE_BORDER_CLAMP || n == 1) {
+        return i < 0 ? 0 : n - 1;
+    }
+    int period = 2 * (n - 1);
+    i %= period;
+    i = i < 0 ? i + period : i;
+    return i < n ? i : period - i;
+}
+
+
 typedef enum {
     IMAGE_RED_CHANNEL,
     IMAGE_GREEN_CHANNEL,
@@ -23,20 +64,124 @@ typedef enum {
     IMAGE_NUM_CHANNELS
 } ImageChannel;
 
+
+/*
+A single pixel of an Image. Channels are stored byte-ordered as red, green, blue, alpha,
+which is the same memory layout as QImage::Format_RGBA8888
+*/
+typedef struct {
+    uchar r, g, b, a;
+} ImagePixel;
+
+
+typedef enum {
+    IMAGE_OP_BRIGHTNESS,
+    IMAGE_OP_CHANNEL_EXTRACT,
+    IMAGE_OP_CONTRAST,
+    IMAGE_OP_GAMMA,
+    IMAGE_OP_SATURATION
+} ImagePointOpType;
+
+
+/*
+A per-pixel operation that can be fused with its neighbours by Image::PointOps.
+factor is the brightness/contrast/saturation factor or gamma exponent, channel is only
+used by IMAGE_OP_CHANNEL_EXTRACT. IMAGE_OP_CONTRAST works around average luminance
+(0-255), or around the image's own average at that point when average is negative
+*/
+typedef struct {
+    ImagePointOpType type;
+    double factor;
+    int channel;
+    double average;
+} ImagePointOp;
+
+typedef enum {
+    IMAGE_COMPOSITE_OVER,
+    IMAGE_COMPOSITE_IN,
+    IMAGE_COMPOSITE_OUT,
+    IMAGE_COMPOSITE_ATOP,
+    IMAGE_COMPOSITE_OPERATIONS
+} ImageCompositeOperation;
+
+
+class Image;
+
+// The pixel buffer behind an Image, shared by its copies and views (defined in Image.cpp)
+struct ImageBuffer;
+
+// Pixels of padding on every side of an allocated pixel buffer, the apron neighborhood
+// operators read beyond the edges (see Image::FillApron). 16 pixels are a cache line
+#define IMAGE_APRON 16
+
+// Rows and columns around a pixel that Image::Nonphotorealism's result for it depends on
+#define IMAGE_NONPHOTOREALISM_HALO 7
+
+// Largest radius of Image::BoxBlur, whose box sums must fit 64 bits
+#define IMAGE_BOX_BLUR_MAX_RADIUS (1 << 24)
+
+/*
+One layer of Image::Composite: image, with its alpha scaled by the luminance of mask, is
+combined with the image so far by operation, after the image so far has its own alpha
+scaled by the luminance of bottom_mask. Either mask may be NULL to leave alpha as it is
+*/
+typedef struct {
+    const Image *bottom_mask;
+    const Image *image;
+    const Image *mask;
+    ImageCompositeOperation operation;
+} ImageLayer;
+
+/*
+Luminance statistics of an image. Luminance is 0.299 r + 0.587 g + 0.114 b in 16.16
+fixed point; the histogram and min/max round it to a level from 0 to 255. The sums are
+integers, so the result does not depend on how the pixels were split between threads
+*/
+typedef struct {
+    quint64 histogram[256]; // pixels at each luminance level
+    quint64 pixels;
+    quint64 sum; // total luminance in 1/65536ths of a level
+    double mean; // 0 to 255
+    int min, max; // darkest and brightest level present, 255 and 0 when there are no pixels
+} ImageStats;
+
+/*
+Adds the pixels counted by part to total, as if both had been one image
+*/
+void ImageStatsAdd(ImageStats *total, const ImageStats &part);
+
+
 using namespace std;
 class Image {
 public:
     /*
     class constructor
+    Copies share the other image's pixel buffer, which is reference-counted: nothing is
+    copied until one of them writes to the pixels (see Detach)
     */
     Image();
     Image(const char *filename);
+    Image(int width, int height);
+    Image(const Image &other);
+    Image &operator=(const Image &other);
 
     /*
     class destructor
     */
     ~Image();
 
+    int Width() const { return width; }
+    int Height() const { return height; }
+
+    /*
+    Returns a pointer to the first pixel of row y. Rows are `Stride()` pixels apart in memory.
+    The pixels may be shared with copies and views of the image, so code that writes
+    through Row() must call Detach() before and PixelsChanged() afterwards
+    */
+    ImagePixel *Row(int y) { return pixels + (ptrdiff_t)y * stride; }
+    const ImagePixel *Row(int y) const { return pixels + (ptrdiff_t)y * stride; }
+    int Stride() const { return stride; }
+
     /*
     Reads a HDR image into an array called image_data
     */
@@ -48,15 +193,46 @@ public:
     bool Write(const char *filename);
 
     /*
-    A description of your implementation for this method goes here
+    Reads or writes filename in the given format. An RGBA PAM file is mapped copy-on-write
+    and used as the pixel buffer as it is, so reading it costs nothing until the pixels are
+    touched and the file itself is never modified. PPM and PFM are mapped and converted.
+    Writing raw formats maps the new file and fills it in parallel
+    */
+    bool Read(const char *filename, ImageFileFormat format);
+    bool Write(const char *filename, ImageFileFormat format);
+
+    /*
+    Edge-preserving blur: each pixel becomes an average of its neighbors weighted by a
+    gaussian of their distance (domainsigma, in pixels) times a gaussian of their
+    difference in luminance (rangesigma, in 0-255 levels).
+    Large domain sigmas are approximated on a downsampled bilateral grid (splat, blur,
+    slice) whose cost barely depends on the sigmas; small ones, where the grid would be
+    too coarse or too large, use BilateralFilterDirect. first_row is the row of a larger
+    image this image's first row is; the grid's cells are laid out in that image's rows,
+    so strips of an image filter exactly like the whole image
+    */
+    void BilateralFilter(double rangesigma, double domainsigma, int first_row = 0);
+
+    /*
+    Reference bilateral filter summing every neighbor within 3 domain sigmas.
+    Cost per pixel grows with the square of domainsigma
     */
-    void BilateralFilter(double rangesigma, double domainsigma);
+    void BilateralFilterDirect(double rangesigma, double domainsigma);
 
     /*
     A description of your implementation for this method goes here
     */
     void BlackAndWhite();
 
+    /*
+    Replaces each pixel with the mean of the (2 radius + 1) x (2 radius + 1) box around
+    it, alpha included, with pixels beyond the edges following border. The box sums come
+    from a summed-area table of the image alone (see ImageIntegral and ImageBorderSum), so
+    neither the cost per pixel nor the memory depends on radius, which must be at most
+    IMAGE_BOX_BLUR_MAX_RADIUS
+    */
+    void BoxBlur(int radius, ImageBorder border = IMAGE_BORDER_CLAMP);
+
     /*
     A description of your implementation for this method goes here
     */
@@ -69,15 +245,67 @@ public:
     void ChannelExtract(int channel);
 
     /*
-    A description of your implementation for this method goes here
+    Composites a stack of count layers onto the image, bottom to top, with the Porter-Duff
+    operations on premultiplied alpha. Each layer is premultiplied, combined and divided
+    back a span of a row at a time, so the whole stack is one pass over the pixels with
+    no intermediate images, and the result is the same as compositing the layers one
+    call at a time. The layers' images and masks must be as wide as the image and cover
+    its rows; first_row is the row of a larger image this image's first row is, so strips
+    of an image read the matching rows of the layers
     */
-    void Composite();
+    void Composite(const ImageLayer *layers, int count, int first_row = 0);
 
     /*
-    A description of your implementation for this method goes here
+    Moves every channel away from (or towards) the image's average luminance by factor.
+    Same as ContrastAround(factor, Stats().mean)
     */
     void Contrast(double factor);
 
+    /*
+    Contrast around a given average luminance, for when the image is one strip of a
+    larger image
+    */
+    void ContrastAround(double factor, double average_lum);
+
+    /*
+    Convolves with a kernel_width x kernel_height kernel of real weights in row-major order:
+    each channel of pixel (x, y) becomes the sum of weight (kx, ky) times pixel
+    (x + kx - kernel_width / 2, y + ky - kernel_height / 2), pixels beyond the edges
+    following border. Small kernels are summed directly; when a cost estimate favours it,
+    large ones are convolved through FFTs of overlapping tiles instead, whose cost per
+    pixel grows with the logarithm of the tile size rather than with the kernel's area.
+    The two paths agree to within a gray level
+    */
+    void Convolve(const float *kernel, int kernel_width, int kernel_height, ImageBorder border = IMAGE_BORDER_CLAMP);
+
+    /*
+    Reference convolution summing every weight, in 16-bit fixed point, with the ImageSimd
+    kernels. Cost per pixel grows with the kernel's area
+    */
+    void ConvolveDirect(const float *kernel, int kernel_width, int kernel_height,
+                        ImageBorder border = IMAGE_BORDER_CLAMP);
+
+    /*
+    Returns the image's luminance statistics. They are computed in one parallel pass the
+    first time they are needed and kept until the pixels change, so operators that need
+    them share the pass. Not safe to call from several threads on the same image
+    */
+    const ImageStats &Stats() const;
+
+    /*
+    Discards cached statistics. Operators do this themselves; code that writes pixels
+    through Row() must call it afterwards
+    */
+    void PixelsChanged();
+
+    /*
+    Gives the image a buffer of its own, holding just its pixels, if the buffer is shared
+    with a copy or view; otherwise does nothing. This is the copy in copy-on-write:
+    operators that write pixels in place call it before they start. Not safe to call
+    from several threads on the same image
+    */
+    void Detach();
+
     /*
     Performs a crop of the image with the following parameters
     top_left_x: the x coordinate of the top left point of the crop window
@@ -85,6 +313,9 @@ public:
     crop_width = width of the crop window to be cut out
     crop_height = height of the crop window to be cut out
     NOTE: all 4 corners of the crop window can be determined by these parameters
+    When the window lies inside the image, the result is a view of the same buffer (an
+    offset into it, with the same stride) and no pixels are copied; otherwise the parts
+    outside the image are filled with opaque black
     */
     void Crop(int top_left_x, int top_left_y, int crop_width, int crop_height);
 
@@ -94,58 +325,194 @@ public:
     void Fun(int sampling_method);
 
     /*
-    A description of your implementation for this method goes here
+    Applies gamma correction to each channel: value = 255 * (value / 255)^(1 / factor)
     */
     void Gamma(double factor);
 
     /*
-    Performs a gaussian blur in both x and y direction with a specified sigma
+    Performs a gaussian blur in both x and y direction with a specified sigma.
+    The blur is separable and uses a third order recursive (Young-van Vliet) filter with
+    Triggs-Sdika boundary handling, so the cost per pixel does not depend on sigma.
+    Small sigmas, where the recursive filter is inaccurate, use GaussianBlurDirect
     */
     void GaussianBlur(double sigma);
 
     /*
-    A description of your implementation for this method goes here
+    Reference gaussian blur by direct separable convolution with a kernel truncated at
+    3 sigma. Cost per pixel grows linearly with sigma
+    */
+    void GaussianBlurDirect(double sigma);
+
+    /*
+    Replaces each pixel with the per-channel median of the filter_width x filter_width window
+    around it, replicating the border pixels. filter_width must be odd and at most 255.
+    Uses the Perreault-Hebert sliding histogram algorithm, so the cost per pixel does not
+    grow with the window size
     */
     void MedianFilter(int filter_width);
 
     /*
-    A description of your implementation for this method goes here
+    Blurs along a straight line, as if the camera moved length pixels in the direction
+    angle (in degrees, counterclockwise from the positive x axis) while the shutter was
+    open. Each pixel becomes the average of a box of that length centered on it, kept as a
+    running sum along rasterised lines, so the cost per pixel does not depend on length.
+    Each line is extended beyond its ends by border, looked up per tap rather than stored,
+    so neither does the memory. first_row is the row of a larger image
+    this image's first row is, so strips of an image blur exactly like the whole image
     */
-    void MotionBlur(double sigma);
+    void MotionBlur(double length, double angle = 0, ImageBorder border = IMAGE_BORDER_CLAMP, int first_row = 0);
 
     /*
-    A description of your implementation for this method goes here
+    A cartoon-like rendering: edge-preserving smoothing (two iterations of a separable
+    bilateral filter), soft quantization of luminance to a few levels, and dark lines
+    where the smoothed luminance has strong Sobel edges. The stages run fused on square
+    tiles, each with the halo of pixels its output depends on, so a tile stays in cache
+    from the first stage to the last and tiles run in parallel. Pixels beyond the image
+    repeat its edge pixels
     */
     void Nonphotorealism();
 
     /*
-    A description of your implementation for this method goes here
+    Copies source into the image with its top left corner at (x, y); source must lie
+    inside the image. Nothing is copied when source is still a view of those very pixels,
+    so a region cropped from a copy of the image and left unchanged pastes back for free
+    */
+    void Paste(const Image &source, int x, int y);
+
+    /*
+    Rotates the image counterclockwise around its center by angle degrees, keeping its size.
+    Regions that come from outside the image follow border, opaque black by default
     */
-    void Rotate(double angle, int sampling_method);
+    void Rotate(double angle, int sampling_method, ImageBorder border = IMAGE_BORDER_ZERO);
 
     /*
     A description of your implementation for this method goes here
     */
     void Saturation(double factor);
 
+    /*
+    Applies a sequence of per-pixel operations in a single pass over the image. The image
+    is walked in small tiles and every operation is applied to a tile before moving on,
+    so each pixel is loaded from memory once no matter how many operations are chained.
+    Consecutive per-channel operations (everything but Saturation) are compiled into one
+    lookup table per channel, so a run of them costs a single table lookup per channel.
+    A Contrast around the image's own average needs the average of the image so far, so
+    it starts a new pass unless it comes first.
+    The result is identical to calling the corresponding methods one after another
+    */
+    void PointOps(const ImagePointOp *ops, int count);
+
     /*
     Scales an image down/up in the x and y direction using a given scale factor and interpolation method.
     NOTE: a scale factor of 1 will not change the image. For example, to scale
     the image up by a factor of 2, scale factor = 2. To scale an image down
     by half, scale factor = 0.5
+    Gaussian and Lanczos sampling resample separably, one axis at a time, with filters
+    widened by the downscaling factor so shrinking does not alias. Filter taps beyond the
+    edges follow border. Area sampling averages the source over each output pixel's
+    footprint, weighting partly covered pixels by their overlap, from a summed-area table;
+    the footprints never leave the image, so it ignores border
     */
-    void Scale(double sx, double sy, int sampling_method);
+    void Scale(double sx, double sy, int sampling_method, ImageBorder border = IMAGE_BORDER_CLAMP);
 
     /*
-    A description of your implementation for this method goes here
+    Sharpens with the 3x3 kernel that weights the pixel by 9 and its eight neighbors by -1.
+    Pixels beyond the edges follow border. The result is opaque
+    */
+    void Sharpen(ImageBorder border = IMAGE_BORDER_CLAMP);
+
+    /*
+    Total bytes of pixel buffers the calling thread has allocated, for measuring what an
+    operation allocates by reading it before and after
     */
-    void Sharpen();
+    static quint64 AllocatedBytes();
 
 private:
-    QImage image_data;
+    /*
+    Allocates an uninitialized pixel buffer of the given size, padded with apron pixels
+    on every side (a multiple of 16, so every row starts on a cache line boundary), and
+    returns its first pixel. The row stride (in pixels) is returned through stride
+    */
+    static ImagePixel *Allocate(int width, int height, int *stride, int apron = IMAGE_APRON);
+
+    /*
+    Frees a buffer from Allocate that was never handed to Replace
+    */
+    static void Free(ImagePixel *pixels, int stride, int apron = IMAGE_APRON);
+
+    /*
+    Releases the current pixel buffer and takes ownership of new_pixels, a buffer from
+    Allocate with the given apron or, when mapping is given, a private mapping of that
+    file (which has none)
+    */
+    void Replace(ImagePixel *new_pixels, int new_width, int new_height, int new_stride, int apron = IMAGE_APRON,
+                 QFile *mapping = NULL);
+
+    /*
+    Fills the radius pixels around the image on every side with border's extension of
+    it, so neighborhood operators can read rows -radius to height + radius - 1 and
+    columns -radius to width + radius - 1 through Row() without checking bounds. The
+    apron is the buffer's padding and is filled lazily: only when an operator asks, and
+    again only once the pixels or the border changed. An image without room for it (a
+    view, a mapped file, a shared buffer or an apron wider than the padding) is first
+    copied into a buffer of its own. Not safe to call from several threads on the same
+    image
+    */
+    void FillApron(int radius, ImageBorder border);
+
+    /*
+    Drops the image's reference to its pixel buffer. The last reference frees the
+    buffer, or unmaps it if it belongs to a file
+    */
+    void Release();
+
+    /*
+    Replaces the image with a new_width x new_height one whose pixel (x, y) samples this
+    image at (m[0] x + m[1] y + m[2], m[3] x + m[4] y + m[5]) using the given sampling
+    method. Samples outside the image follow border
+    */
+    void Warp(const double *matrix, int new_width, int new_height, int sampling_method, ImageBorder border);
+
+    /*
+    Resizes to new_width x new_height with a gaussian or lanczos filter, in a horizontal and
+    a vertical pass. Pixel centers are aligned, and taps beyond the edges follow border
+    */
+    void Resample(int new_width, int new_height, int sampling_method, ImageBorder border);
+
+    /*
+    Resizes to new_width x new_height by area sampling. The table's sums at the corners
+    of each footprint are interpolated bilinearly, which is exact for the integral of an
+    image of constant pixels, so four interpolated sums give any footprint's area average
+    */
+    void ResampleArea(int new_width, int new_height);
+
+    /*
+    Replaces the image with its convolution by a kernel fixed at compile time. Defined in
+    ImageConvolve.hpp, which describes the kernels it takes
+    */
+    template <class Kernel> void Convolve(ImageBorder border);
+
+    /*
+    The FFT path of Convolve, in tile x tile tiles (a power of two larger than the kernel)
+    */
+    void ConvolveFft(const float *kernel, int kernel_width, int kernel_height, int tile, ImageBorder border);
+
+    /*
+    Bilateral filter on a grid sampled every domainsigma pixels and rangesigma levels,
+    with rows of cells counted from row 0 of the image first_row belongs to
+    */
+    void BilateralFilterGrid(double rangesigma, double domainsigma, int first_row);
+
+    // The image's first pixel, anywhere inside buffer's pixels when it is a view
+    ImagePixel *pixels;
+    ImageBuffer *buffer;
+    int stride;
     int width;
     int height;
     int npixels;
+    // Cached by Stats() until the pixels change
+    mutable ImageStats stats;
+    mutable bool statsValid;
 };
 
 #endif
@@ -0,0 +1,195 @@
+#include "ImageConvolve.hpp"
+#include "ImageFft.hpp"
+
+#include <stdio.h>
+
+// Nanoseconds for one tap of direct convolution at one pixel, for one FFT butterfly, and
+// for gathering, multiplying and writing back one tile cell, measured on one AVX2 core.
+// Convolve takes the FFT path when its tiles cost less than the direct taps
+#define CONVOLVE_TAP_COST 0.9
+#define CONVOLVE_BUTTERFLY_COST 1.2
+#define CONVOLVE_CELL_COST 7.5
+
+// FFT tile sizes tried, a power of two between these. Larger tiles no longer fit in L2
+// and the butterflies slow down to more than twice their cost
+#define CONVOLVE_MIN_TILE 64
+#define CONVOLVE_MAX_TILE 512
+
+// Cost of convolving a width x height image in tile x tile FFT tiles, or -1 if the kernel
+// does not fit in the tile
+static double FftCost(int width, int height, int kernel_width, int kernel_height, int tile)
+{
+    int bx = tile - kernel_width + 1, by = tile - kernel_height + 1;
+    if (bx < 1 || by < 1) {
+        return -1;
+    }
+    int log2 = 0;
+    while ((1 << log2) < tile) {
+        log2++;
+    }
+    // Two forward and two inverse 2D transforms per tile, each log2 levels of cells / 2
+    // butterflies over the columns and again over the rows
+    double tiles = (double)((width + bx - 1) / bx) * ((height + by - 1) / by);
+    return tiles * tile * tile * (4 * log2 * CONVOLVE_BUTTERFLY_COST + CONVOLVE_CELL_COST);
+}
+
+void Image::Convolve(const float *kernel, int kernel_width, int kernel_height, ImageBorder border)
+{
+    if (kernel_width <= 0 || kernel_height <= 0) {
+        fputs("Convolution kernel must have a positive size\n", stderr);
+        exit(-1);
+    }
+    int taps = 0;
+    for (int i = 0; i < kernel_width * kernel_height; i++) {
+        taps += kernel[i] != 0;
+    }
+    double direct = (double)width * height * taps * CONVOLVE_TAP_COST;
+    int best = 0;
+    double best_cost = direct;
+    for (int tile = CONVOLVE_MIN_TILE; tile <= CONVOLVE_MAX_TILE; tile *= 2) {
+        double cost = FftCost(width, height, kernel_width, kernel_height, tile);
+        if (cost >= 0 && cost < best_cost) {
+            best = tile;
+            best_cost = cost;
+        }
+    }
+    if (best) {
+        ConvolveFft(kernel, kernel_width, kernel_height, best, border);
+    }
+    else {
+        ConvolveDirect(kernel, kernel_width, kernel_height, border);
+    }
+}
+
+void Image::ConvolveDirect(const float *kernel, int kernel_width, int kernel_height, ImageBorder border)
+{
+    if (kernel_width <= 0 || kernel_height <= 0) {
+        fputs("Convolution kernel must have a positive size\n", stderr);
+        exit(-1);
+    }
+    int n = kernel_width * kernel_height;
+    double magnitude = 0;
+    for (int i = 0; i < n; i++) {
+        magnitude += qAbs(kernel[i]);
+    }
+    // Fixed-point weights with as many fraction bits (up to 16) as the 32-bit sums allow
+    int shift = 16;
+    while (shift > 0 && magnitude * (1 << shift) > INT_MAX / 255 / 2) {
+        shift--;
+    }
+    if (magnitude * (1 << shift) > INT_MAX / 255 / 2) {
+        fputs("Convolution kernel weights are too large\n", stderr);
+        exit(-1);
+    }
+    // Round the running total so the weights keep their sum
+    int *weights = (int *)malloc(n * sizeof(int));
+    double total = 0;
+    qint64 assigned = 0;
+    for (int i = 0; i < n; i++) {
+        total += kernel[i];
+        qint64 next = qRound64(total * (1 << shift));
+        weights[i] = (int)(next - assigned);
+        assigned = next;
+    }
+    FillApron(qMax(kernel_width, kernel_height) / 2, border);
+    int new_stride;
+    ImagePixel *convolved = Allocate(width, height, &new_stride);
+    ImageParallelRows(height, [&](int first, int end) {
+        ImageConvolveDirect(*this, convolved, new_stride, first, end, weights, kernel_width, kernel_height, shift);
+    });
+    free(weights);
+    Replace(convolved, width, height, new_stride);
+}
+
+static inline uchar RoundChannel(float v)
+{
+    return v <= 0 ? 0 : v >= 255 ? 255 : (uchar)(v + 0.5f);
+}
+
+void Image::ConvolveFft(const float *kernel, int kernel_width, int kernel_height, int tile, ImageBorder border)
+{
+    const int cx = kernel_width / 2, cy = kernel_height / 2;
+    const int bx = tile - kernel_width + 1, by = tile - kernel_height + 1;
+    const int tiles_x = (width + bx - 1) / bx, tiles_y = (height + by - 1) / by;
+    const size_t cells = (size_t)tile * tile;
+    ImageFft fft(tile);
+
+    // The kernel's spectrum, shared by every tile. The kernel is stored reversed, so the
+    // circular convolution of a tile with it sums pixel (x + kx - cx, y + ky - cy) times
+    // weight (kx, ky) at (x, y), and scaled by the inverse transform's 1 / cells
+    float *spectrum = (float *)calloc(2 * cells, sizeof(float));
+    float *sre = spectrum, *sim = spectrum + cells;
+    for (int ky = 0; ky < kernel_height; ky++) {
+        for (int kx = 0; kx < kernel_width; kx++) {
+            sre[(size_t)((tile - ky) % tile) * tile + (tile - kx) % tile] = kernel[ky * kernel_width + kx] / cells;
+        }
+    }
+    fft.Transform2D(sre, sim, false);
+
+    // Overlap-save: each tile reads a tile x tile block around its bx x by output pixels,
+    // so wraparound only reaches pixels it discards and tiles run independently. Kernels
+    // this large reach past the apron, so the border comes from the source column and
+    // row of each coordinate, offset by cx and cy (-1 for black). The last tiles run
+    // past those into pixels that only reach discarded outputs, which repeat the last one
+    const int padded_width = width + 2 * cx, padded_height = height + 2 * cy;
+    int *columns = (int *)malloc((padded_width + padded_height) * sizeof(int)), *rows = columns + padded_width;
+    for (int i = 0; i < padded_width; i++) {
+        columns[i] = ImageBorderIndex(i - cx, width, border);
+    }
+    for (int j = 0; j < padded_height; j++) {
+        rows[j] = ImageBorderIndex(j - cy, height, border);
+    }
+    const ImagePixel black = { 0, 0, 0, 0xff };
+    int new_stride;
+    ImagePixel *convolved = Allocate(width, height, &new_stride);
+    ImageParallelRows(tiles_x * tiles_y, [&](int first, int end) {
+        // Red and green, then blue and alpha, as the real and imaginary parts of two
+        // complex planes: the kernel is real, so the parts do not mix
+        float *planes = (float *)malloc(4 * cells * sizeof(float));
+        float *r = planes, *g = planes + cells, *b = planes + 2 * cells, *a = planes + 3 * cells;
+        for (int t = first; t < end; t++) {
+            int ox = (t % tiles_x) * bx, oy = (t / tiles_x) * by;
+            for (int j = 0; j < tile; j++) {
+                int sy = rows[qMin(oy + j, padded_height - 1)];
+                const ImagePixel *row = sy < 0 ? NULL : Row(sy);
+                for (int i = 0; i < tile; i++) {
+                    int sx = columns[qMin(ox + i, padded_width - 1)];
+                    const ImagePixel &p = row && sx >= 0 ? row[sx] : black;
+                    size_t c = (size_t)j * tile + i;
+                    r[c] = p.r;
+                    g[c] = p.g;
+                    b[c] = p.b;
+                    a[c] = p.a;
+                }
+            }
+            fft.Transform2D(r, g, false);
+            fft.Transform2D(b, a, false);
+            for (size_t c = 0; c < cells; c++) {
+                float re = r[c] * sre[c] - g[c] * sim[c], im = r[c] * sim[c] + g[c] * sre[c];
+                r[c] = re;
+                g[c] = im;
+                re = b[c] * sre[c] - a[c] * sim[c];
+                im = b[c] * sim[c] + a[c] * sre[c];
+                b[c] = re;
+                a[c] = im;
+            }
+            fft.Transform2D(r, g, true);
+            fft.Transform2D(b, a, true);
+            int nx = qMin(bx, width - ox), ny = qMin(by, height - oy);
+            for (int j = 0; j < ny; j++) {
+                ImagePixel *out = convolved + (size_t)(oy + j) * new_stride + ox;
+                for (int i = 0; i < nx; i++) {
+                    size_t c = (size_t)j * tile + i;
+                    out[i].r = RoundChannel(r[c]);
+                    out[i].g = RoundChannel(g[c]);
+                    out[i].b = RoundChannel(b[c]);
+                    out[i].a = RoundChannel(a[c]);
+                }
+            }
+        }
+        free(planes);
+    });
+    free(spectrum);
+    free(columns);
+    Replace(convolved, width, height, new_stride);
+}
@@ -0,0 +1,221 @@
+#ifndef IMAGECONVOLVE_HPP
+#define IMAGECONVOLVE_HPP
+
+#include "Image.hpp"
+#include "ImageSimd.hpp"
+#include "ImageThreads.hpp"
+
+#include <limits.h>
+#include <stdlib.h>
+
+/*
+Convolution with small integer kernels known at compile time. A kernel is a class like
+
+    struct SharpenKernel {
+        enum { size = 3, shift = 0, opaque = 1 };
+        static constexpr int Weight(int y, int x) { return y == 1 && x == 1 ? 9 : -1; }
+    };
+
+with an odd size, weights for 0 <= y, x < size and a result that is
+clamp((sum of weight * pixel + round) >> shift) for each channel, alpha included unless
+opaque is set, when the result's alpha is 255.
+Pixels outside the image come from its apron (see Image::FillApron), filled with the
+ImageBorder the operator was given.
+
+Whether the kernel is separable (the product of a column and a row of integers) is
+decided at compile time. Separable kernels take size + size multiplies per channel
+instead of size * size: a vertical pass into a row of 32-bit sums, then a horizontal
+pass over it. Every tap is an ImageSimd Accumulate over a span of the row, and zero
+weights are skipped. Taps beyond the edges read the apron, so no span checks bounds and
+the edge pixels take the same SIMD path as the rest.
+
+Kernels that are not separable, and float kernels only known at run time (converted to
+fixed point by Image::ConvolveDirect), sum every tap with ImageConvolveDirect
+*/
+
+// Pixels of a row each tap accumulates before the next tap runs. 512 pixels of 32-bit
+// sums (8 KB) stay in L1 while all the taps are added to them
+#define IMAGE_CONVOLVE_SPAN 512
+
+// First nonzero weight in row-major order, the pivot of the separability test
+template <class Kernel>
+constexpr int ImageKernelPivot(int i = 0)
+{
+    return i == Kernel::size * Kernel::size ||
+           Kernel::Weight(i / Kernel::size, i % Kernel::size) != 0 ? i : ImageKernelPivot<Kernel>(i + 1);
+}
+
+// True if every 2x2 minor through the pivot (py, px) vanishes, from index i on
+template <class Kernel>
+constexpr bool ImageKernelRankOne(int py, int px, int i = 0)
+{
+    return i == Kernel::size * Kernel::size ||
+           (Kernel::Weight(i / Kernel::size, i % Kernel::size) * Kernel::Weight(py, px) ==
+            Kernel::Weight(i / Kernel::size, px) * Kernel::Weight(py, i % Kernel::size) &&
+            ImageKernelRankOne<Kernel>(py, px, i + 1));
+}
+
+constexpr int ImageKernelGcd(int a, int b)
+{
+    return b == 0 ? (a < 0 ? -a : a) : ImageKernelGcd(b, a % b);
+}
+
+// Greatest common divisor of row y from column x on
+template <class Kernel>
+constexpr int ImageKernelRowGcd(int y, int x = 0)
+{
+    return x == Kernel::size ? 0 : ImageKernelGcd(Kernel::Weight(y, x), ImageKernelRowGcd<Kernel>(y, x + 1));
+}
+
+// Sum of the absolute weights from index i on, which bounds a sum of 8-bit channels
+template <class Kernel>
+constexpr int ImageKernelMagnitude(int i = 0)
+{
+    return i == Kernel::size * Kernel::size ? 0 :
+           (Kernel::Weight(i / Kernel::size, i % Kernel::size) < 0 ? -1 : 1) *
+           Kernel::Weight(i / Kernel::size, i % Kernel::size) + ImageKernelMagnitude<Kernel>(i + 1);
+}
+
+template <class Kernel>
+struct ImageKernelTraits {
+    enum {
+        radius = Kernel::size / 2,
+        pivot = ImageKernelPivot<Kernel>(),
+        pivot_y = pivot / Kernel::size,
+        pivot_x = pivot % Kernel::size,
+        separable = pivot < Kernel::size * Kernel::size && ImageKernelRankOne<Kernel>(pivot_y, pivot_x)
+    };
+
+    /*
+    Factors of a separable kernel: the pivot's row divided by its greatest common divisor
+    is a row of integers with no common factor, so every other row is an integer multiple
+    of it and Weight(y, x) == Column(y) * Row(x) exactly
+    */
+    static constexpr int Row(int x)
+    {
+        return Kernel::Weight(pivot_y, x) / ImageKernelRowGcd<Kernel>(pivot_y);
+    }
+    static constexpr int Column(int y)
+    {
+        return Kernel::Weight(y, pivot_x) / Row(pivot_x);
+    }
+};
+
+// Packs n pixels of sums into out, then makes them opaque if asked
+static inline void ImageConvolvePack(const ImageSimdKernels *kernels, ImagePixel *out, int n, const qint32 *acc,
+                                     int shift, bool opaque)
+{
+    kernels->Pack(out, n, acc, shift);
+    for (int i = 0; opaque && i < n; i++) {
+        out[i].a = 0xff;
+    }
+}
+
+/*
+Convolves rows [first, end) of src with a size_x x size_y kernel of integer weights in
+row-major order, centered on (size_x / 2, size_y / 2), into out_pixels, with alpha 255 if
+opaque. src's apron must hold at least size_x / 2 columns and size_y / 2 rows. The
+general path, used by kernels that are not separable and by kernels only known at run time
+*/
+static inline void ImageConvolveDirect(const Image &src, ImagePixel *out_pixels, int out_stride, int first, int end,
+                                       const int *weights, int size_x, int size_y, int shift, bool opaque = false)
+{
+    const int cx = size_x / 2, cy = size_y / 2;
+    const int width = src.Width();
+    const ImageSimdKernels *kernels = ImageSimd();
+    qint32 acc[IMAGE_CONVOLVE_SPAN * 4];
+    for (int y = first; y < end; y++) {
+        ImagePixel *out = out_pixels + (size_t)y * out_stride;
+        for (int x = 0; x < width; x += IMAGE_CONVOLVE_SPAN) {
+            int n = qMin(IMAGE_CONVOLVE_SPAN, width - x);
+            memset(acc, 0, (size_t)n * 4 * sizeof(qint32));
+            for (int ky = 0; ky < size_y; ky++) {
+                const ImagePixel *line = src.Row(y + ky - cy) + x - cx;
+                for (int kx = 0; kx < size_x; kx++) {
+                    int w = weights[ky * size_x + kx];
+                    if (w != 0) {
+                        kernels->Accumulate(acc, line + kx, n, w);
+                    }
+                }
+            }
+            ImageConvolvePack(kernels, out + x, n, acc, shift, opaque);
+        }
+    }
+}
+
+/*
+Convolves rows [first, end) of src into out_pixels, specialized on whether the kernel is
+separable. The general case sums every tap with ImageConvolveDirect
+*/
+template <class Kernel, bool separable = ImageKernelTraits<Kernel>::separable>
+struct ImageConvolveRows {
+    static void Run(const Image &src, ImagePixel *out_pixels, int out_stride, int first, int end)
+    {
+        int weights[Kernel::size * Kernel::size];
+        for (int i = 0; i < Kernel::size * Kernel::size; i++) {
+            weights[i] = Kernel::Weight(i / Kernel::size, i % Kernel::size);
+        }
+        ImageConvolveDirect(src, out_pixels, out_stride, first, end, weights, Kernel::size, Kernel::size,
+                            Kernel::shift, Kernel::opaque);
+    }
+};
+
+// A vertical pass of the column factors into 32-bit sums, then a horizontal pass of the
+// row factors over the sums. The sums cover the apron's columns too, so the horizontal
+// pass reads past the edges like the vertical one
+template <class Kernel>
+struct ImageConvolveRows<Kernel, true> {
+    static void Run(const Image &src, ImagePixel *out_pixels, int out_stride, int first, int end)
+    {
+        typedef ImageKernelTraits<Kernel> Traits;
+        const int size = Kernel::size, radius = Traits::radius;
+        const int width = src.Width(), padded = width + 2 * radius;
+        const ImageSimdKernels *kernels = ImageSimd();
+        int column[size], row[size];
+        for (int i = 0; i < size; i++) {
+            column[i] = Traits::Column(i);
+            row[i] = Traits::Row(i);
+        }
+        qint32 acc[IMAGE_CONVOLVE_SPAN * 4];
+        // sums[4 * i + c] is the vertical sum at column i - radius
+        qint32 *sums = (qint32 *)malloc((size_t)padded * 4 * sizeof(qint32));
+        for (int y = first; y < end; y++) {
+            // The whole row of sums first, the horizontal pass reads across spans
+            memset(sums, 0, (size_t)padded * 4 * sizeof(qint32));
+            for (int ky = 0; ky < size; ky++) {
+                const ImagePixel *line = src.Row(y + ky - radius) - radius;
+                for (int x = 0; column[ky] != 0 && x < padded; x += IMAGE_CONVOLVE_SPAN) {
+                    kernels->Accumulate(sums + 4 * x, line + x, qMin(IMAGE_CONVOLVE_SPAN, padded - x), column[ky]);
+                }
+            }
+            ImagePixel *out = out_pixels + (size_t)y * out_stride;
+            for (int x = 0; x < width; x += IMAGE_CONVOLVE_SPAN) {
+                int n = qMin(IMAGE_CONVOLVE_SPAN, width - x);
+                memset(acc, 0, (size_t)n * 4 * sizeof(qint32));
+                for (int kx = 0; kx < size; kx++) {
+                    if (row[kx] != 0) {
+                        kernels->AccumulateSums(acc, sums + 4 * (x + kx), n, row[kx]);
+                    }
+                }
+                ImageConvolvePack(kernels, out + x, n, acc, Kernel::shift, Kernel::opaque);
+            }
+        }
+        free(sums);
+    }
+};
+
+template <class Kernel>
+void Image::Convolve(ImageBorder border)
+{
+    static_assert(Kernel::size % 2 == 1, "Kernel size must be odd");
+    static_assert(ImageKernelMagnitude<Kernel>() <= INT_MAX / 255 / 2, "Kernel weights overflow 32-bit sums");
+    FillApron(Kernel::size / 2, border);
+    int new_stride;
+    ImagePixel *convolved = Allocate(width, height, &new_stride);
+    ImageParallelRows(height, [&](int first, int end) {
+        ImageConvolveRows<Kernel>::Run(*this, convolved, new_stride, first, end);
+    });
+    Replace(convolved, width, height, new_stride);
+}
+
+#endif
@@ -0,0 +1,73 @@
+#include "ImageFft.hpp"
+#include "ImageSimd.hpp"
+
+#include <math.h>
+#include <algorithm>
+
+ImageFft::ImageFft(int n)
+    : n(n), reversed(n), cosines(n / 2), sines(n / 2)
+{
+    int bits = 0;
+    while ((1 << bits) < n) {
+        bits++;
+    }
+    for (int i = 0; i < n; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) {
+            r |= (i >> b & 1) << (bits - 1 - b);
+        }
+        reversed[i] = r;
+    }
+    // In double, so the factors are accurate to float precision even for large n
+    for (int k = 0; k < n / 2; k++) {
+        double angle = -2 * M_PI * k / n;
+        cosines[k] = (float)cos(angle);
+        sines[k] = (float)sin(angle);
+    }
+}
+
+void ImageFft::Transform(float *re, float *im, int lanes, bool inverse) const
+{
+    for (int i = 0; i < n; i++) {
+        if (i < reversed[i]) {
+            size_t a = (size_t)i * lanes, b = (size_t)reversed[i] * lanes;
+            std::swap_ranges(re + a, re + a + lanes, re + b);
+            std::swap_ranges(im + a, im + a + lanes, im + b);
+        }
+    }
+    const ImageSimdKernels *kernels = ImageSimd();
+    float sign = inverse ? -1 : 1;
+    for (int length = 2; length <= n; length *= 2) {
+        int half = length / 2, step = n / length;
+        for (int start = 0; start < n; start += length) {
+            for (int k = 0; k < half; k++) {
+                size_t a = (size_t)(start + k) * lanes, b = a + (size_t)half * lanes;
+                kernels->Butterfly(re + a, im + a, re + b, im + b, lanes, cosines[k * step], sign * sines[k * step]);
+            }
+        }
+    }
+}
+
+// Transposes an n x n array in place, in blocks that stay in L1
+static void Transpose(float *data, int n)
+{
+    const int block = 16;
+    for (int by = 0; by < n; by += block) {
+        for (int bx = by; bx < n; bx += block) {
+            for (int y = by; y < std::min(by + block, n); y++) {
+                for (int x = bx == by ? y + 1 : bx; x < std::min(bx + block, n); x++) {
+                    std::swap(data[(size_t)y * n + x], data[(size_t)x * n + y]);
+                }
+            }
+        }
+    }
+}
+
+void ImageFft::Transform2D(float *re, float *im, bool inverse) const
+{
+    // Columns, then the rows as the columns of the transpose
+    Transform(re, im, n, inverse);
+    Transpose(re, n);
+    Transpose(im, n);
+    Transform(re, im, n, inverse);
+}
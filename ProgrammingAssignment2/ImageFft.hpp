@@ -0,0 +1,46 @@
+#ifndef IMAGEFFT_HPP
+#define IMAGEFFT_HPP
+
+#include <vector>
+
+/*
+Radix-2 fast Fourier transform of a fixed power-of-two size, used by the FFT path of
+Image::Convolve. Complex values are split into an array of real parts and an array of
+imaginary parts. The transform is unnormalized: a forward and an inverse transform
+multiply every value by the size (by size * size in 2D).
+
+The butterflies of one pass apply the same twiddle factor to a whole run of lanes, so the
+columns of a 2D array are transformed together, a row at a time, with the ImageSimd
+Butterfly kernel
+*/
+class ImageFft {
+public:
+    /*
+    Plans transforms of n values, n a power of two
+    */
+    ImageFft(int n);
+
+    int Size() const { return n; }
+
+    /*
+    Transforms lanes interleaved sequences of Size() values in place: value i of lane l is
+    (re, im)[i * lanes + l]. Forward is X[k] = sum x[i] e^(-2 pi i k / n), inverse uses
+    e^(+2 pi i k / n)
+    */
+    void Transform(float *re, float *im, int lanes, bool inverse) const;
+
+    /*
+    Transforms a Size() x Size() array in place. The result is transposed: the forward
+    transform leaves the spectrum of row frequency v and column frequency u at [u][v]
+    rather than [v][u], and the inverse transform takes that layout and returns the array
+    in its usual one. Products of spectra need nothing else
+    */
+    void Transform2D(float *re, float *im, bool inverse) const;
+
+private:
+    int n;
+    std::vector<int> reversed; // bit-reversed index of each index
+    std::vector<float> cosines, sines; // of -2 pi k / n for k < n / 2
+};
+
+#endif
@@ -0,0 +1,120 @@
+#include "ImageIntegral.hpp"
+#include "ImageThreads.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+ImageIntegral::ImageIntegral(const Image &image)
+{
+    const int width = image.Width(), height = image.Height();
+    stride = 4 * ((size_t)width + 1);
+    table = (quint64 *)malloc(((size_t)height + 1) * stride * sizeof(quint64));
+    if (!table) {
+        fputs("Unable to allocate summed-area table\n", stderr);
+        exit(-1);
+    }
+    memset(table, 0, stride * sizeof(quint64));
+    // One band of rows per thread, each summed as if it were the top of the image: a row
+    // is its running sums plus the row above, the zero first row for a band's first row
+    const int bands = qMax(qMin(ImageThreads(), height), 1);
+    ImageParallelRows(bands, [&](int first_band, int end_band) {
+        for (int b = first_band; b < end_band; b++) {
+            int first = b * height / bands, end = (b + 1) * height / bands;
+            for (int y = first; y < end; y++) {
+                const ImagePixel *src = image.Row(y);
+                quint64 *row = table + (size_t)(y + 1) * stride;
+                const quint64 *above = y == first ? table : row - stride;
+                quint64 sum[4] = { 0, 0, 0, 0 };
+                memset(row, 0, 4 * sizeof(quint64));
+                for (int x = 0; x < width; x++) {
+                    sum[0] += src[x].r;
+                    sum[1] += src[x].g;
+                    sum[2] += src[x].b;
+                    sum[3] += src[x].a;
+                    for (int c = 0; c < 4; c++) {
+                        row[4 * (x + 1) + c] = sum[c] + above[4 * (x + 1) + c];
+                    }
+                }
+            }
+        }
+    });
+    // Then every band but the first adds the last row of the band above it, a band at a
+    // time, so that row already holds the sums over every band above
+    for (int b = 1; b < bands; b++) {
+        int first = b * height / bands, end = (b + 1) * height / bands;
+        const quint64 *offset = table + (size_t)first * stride;
+        ImageParallelRows(end - first, [&](int band_first, int band_end) {
+            for (int y = first + band_first; y < first + band_end; y++) {
+                quint64 *row = table + (size_t)(y + 1) * stride;
+                for (size_t i = 0; i < stride; i++) {
+                    row[i] += offset[i];
+                }
+            }
+        });
+    }
+}
+
+ImageIntegral::~ImageIntegral()
+{
+    free(table);
+}
+
+// Adds sign times T(i) to the terms, merged with a term of the same index
+static void AddTerm(int i, quint64 sign, quint64 scale, int *index, quint64 *weight, int *count)
+{
+    for (int t = 0; t < *count; t++) {
+        if (index[t] == i) {
+            weight[t] += sign * scale;
+            return;
+        }
+    }
+    index[*count] = i;
+    weight[(*count)++] = sign * scale;
+}
+
+// Adds sign times the sum of the extended entries [0, x) (minus [x, 0) when x < 0)
+static void AddPrefix(qint64 x, int n, ImageBorder border, quint64 sign, int *index, quint64 *weight, int *count)
+{
+    if (0 <= x && x <= n) {
+        AddTerm((int)x, sign, 1, index, weight, count);
+    }
+    else if (border == IMAGE_BORDER_ZERO) {
+        AddTerm(x < 0 ? 0 : n, sign, 1, index, weight, count);
+    }
+    else if (border == IMAGE_BORDER_CLAMP || n == 1) {
+        // Entry 0 or n - 1 repeated: T(1) or T(n) - T(n - 1) for each
+        if (x < 0) {
+            AddTerm(1, sign, (quint64)x, index, weight, count);
+        }
+        else {
+            AddTerm(n, sign, (quint64)(x - n + 1), index, weight, count);
+            AddTerm(n - 1, sign, -(quint64)(x - n), index, weight, count);
+        }
+    }
+    else {
+        // Reflected without repeating the ends, the entries repeat every period, whose
+        // sum is T(n) + T(n - 1) - T(1); the rest of x is a prefix of one period
+        const qint64 period = 2 * (qint64)(n - 1);
+        qint64 k = x >= 0 ? x / period : -((-x + period - 1) / period), r = x - k * period;
+        AddTerm(n, sign, (quint64)k, index, weight, count);
+        AddTerm(n - 1, sign, (quint64)k, index, weight, count);
+        AddTerm(1, sign, -(quint64)k, index, weight, count);
+        if (r <= n) {
+            AddTerm((int)r, sign, 1, index, weight, count);
+        }
+        else {
+            AddTerm(n, sign, 1, index, weight, count);
+            AddTerm(n - 1, sign, 1, index, weight, count);
+            AddTerm((int)(period - r + 1), sign, -(quint64)1, index, weight, count);
+        }
+    }
+}
+
+int ImageBorderSum(qint64 x0, qint64 x1, int n, ImageBorder border, int *index, quint64 *weight)
+{
+    int count = 0;
+    AddPrefix(x1, n, border, 1, index, weight, &count);
+    AddPrefix(x0, n, border, -(quint64)1, index, weight, &count);
+    return count;
+}
@@ -0,0 +1,57 @@
+#ifndef IMAGEINTEGRAL_HPP
+#define IMAGEINTEGRAL_HPP
+
+#include "Image.hpp"
+
+/*
+Summed-area table of an image: entry (x, y) holds the sums of each channel over the
+pixels above and to the left of it, so the sum over any rectangle takes four reads
+whatever its size. Used by Image::BoxBlur and the area sampling of Image::Scale.
+
+The sums are 64-bit, so they cannot overflow however large the image is, and the table
+takes 32 bytes per pixel. It is built in one pass per thread, over a band of rows each,
+and a second pass in which the bands below the first add the sums above them
+*/
+class ImageIntegral {
+public:
+    ImageIntegral(const Image &image);
+    ~ImageIntegral();
+
+    /*
+    Entries of row y, for y from 0 to image height: entry x, from 0 to image width, is
+    the 4 channel sums at Row(y) + 4 * x over the pixels [0, x) x [0, y)
+    */
+    const quint64 *Row(int y) const { return table + (size_t)y * stride; }
+
+    /*
+    Sums of each channel over the pixels [x0, x1) x [y0, y1)
+    */
+    void Sum(int x0, int y0, int x1, int y1, quint64 sum[4]) const
+    {
+        const quint64 *top = Row(y0), *bottom = Row(y1);
+        for (int c = 0; c < 4; c++) {
+            sum[c] = bottom[4 * x1 + c] - bottom[4 * x0 + c] - top[4 * x1 + c] + top[4 * x0 + c];
+        }
+    }
+
+private:
+    Q_DISABLE_COPY(ImageIntegral)
+
+    size_t stride; // entries per row, 4 per pixel
+    quint64 *table;
+};
+
+// Most terms ImageBorderSum returns
+#define IMAGE_BORDER_SUM_TERMS 12
+
+/*
+The sum over entries [x0, x1) of a row of n entries extended past its ends by border, as
+terms of the row's prefix sums T(0) = 0 to T(n): it is the sum of weight[i] * T(index[i])
+over the returned number of terms. Entries beyond the row count as zero with
+IMAGE_BORDER_ZERO, alpha included. However far the range reaches there are at most
+IMAGE_BORDER_SUM_TERMS terms, and 2 when it lies inside the row. The weights wrap
+modulo 2^64, so a sum taken in quint64 is exact whenever the true sum fits
+*/
+int ImageBorderSum(qint64 x0, qint64 x1, int n, ImageBorder border, int *index, quint64 *weight);
+
+#endif
@@ -0,0 +1,1084 @@
+#include "ImageSimd.hpp"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define IMAGE_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only emit SSE4.1/AVX2 instructions inside functions marked for
+// those targets; MSVC allows the intrinsics anywhere
+#if defined(__GNUC__)
+#define IMAGE_TARGET(isa) __attribute__((target(isa)))
+#else
+#define IMAGE_TARGET(isa)
+#endif
+
+// Fixed-point luminance weights, 0.299 0.587 0.114 scaled by 65536 (they sum to 65536)
+#define LUM_R 19595
+#define LUM_G 38470
+#define LUM_B 7471
+
+// The same weights scaled by 256, for mask luminance in 16-bit multiply-adds
+#define MASK_R 77
+#define MASK_G 150
+#define MASK_B 29
+
+
+/*
+Scalar kernels. These define the exact results the SIMD kernels must reproduce
+*/
+
+static inline int MixChannel(int value, int factor, int lum)
+{
+    int t = (lum << 12) + ((value << 8) - lum) * factor + (1 << 19);
+    return qBound(0, t >> 20, 255);
+}
+
+static void ScaleScalar(ImagePixel *p, int n, int factor)
+{
+    for (int x = 0; x < n; x++) {
+        p[x].r = qMin((p[x].r * factor + 32768) >> 16, 255);
+        p[x].g = qMin((p[x].g * factor + 32768) >> 16, 255);
+        p[x].b = qMin((p[x].b * factor + 32768) >> 16, 255);
+    }
+}
+
+static void MixScalar(ImagePixel *p, int n, int factor, int lum)
+{
+    for (int x = 0; x < n; x++) {
+        int l = lum >= 0 ? lum : (p[x].r * LUM_R + p[x].g * LUM_G + p[x].b * LUM_B + 128) >> 8;
+        p[x].r = MixChannel(p[x].r, factor, l);
+        p[x].g = MixChannel(p[x].g, factor, l);
+        p[x].b = MixChannel(p[x].b, factor, l);
+    }
+}
+
+static void MaskScalar(ImagePixel *p, int n, quint32 mask)
+{
+    quint32 *rgba = (quint32 *)p;
+    for (int x = 0; x < n; x++) {
+        rgba[x] &= mask;
+    }
+}
+
+static void HistogramScalar(quint16 *h, const quint16 *add, const quint16 *sub, int n)
+{
+    for (int i = 0; i < n; i++) {
+        h[i] = (quint16)(h[i] + add[i] - sub[i]);
+    }
+}
+
+static inline ImagePixel WarpTap(const ImageWarpSource *src, int x, int y)
+{
+    x = ImageWarpCoordinate(x, src->width, src->border);
+    y = ImageWarpCoordinate(y, src->height, src->border);
+    return src->pixels[(ptrdiff_t)y * src->stride + x];
+}
+
+// Warps pixels [first, n) of the span, so SIMD kernels can hand over their remainder
+static void WarpSpan(ImagePixel *out, int first, int n, const ImageWarpSource *src,
+                     float x, float y, float dx, float dy, bool bilinear)
+{
+    for (int i = first; i < n; i++) {
+        float fx = x + (float)i * dx, fy = y + (float)i * dy;
+        if (!bilinear) {
+            out[i] = WarpTap(src, (int)floorf(fx + 0.5f), (int)floorf(fy + 0.5f));
+            continue;
+        }
+        float x1 = floorf(fx), y1 = floorf(fy);
+        int wx = (int)((fx - x1) * 256 + 0.5f), wy = (int)((fy - y1) * 256 + 0.5f);
+        ImagePixel q[4] = {
+            WarpTap(src, (int)x1, (int)y1), WarpTap(src, (int)x1 + 1, (int)y1),
+            WarpTap(src, (int)x1, (int)y1 + 1), WarpTap(src, (int)x1 + 1, (int)y1 + 1)
+        };
+        const uchar *c11 = &q[0].r, *c21 = &q[1].r, *c12 = &q[2].r, *c22 = &q[3].r;
+        uchar *result = &out[i].r;
+        for (int c = 0; c < 4; c++) {
+            int top = c11[c] * (256 - wx) + c21[c] * wx,
+                bottom = c12[c] * (256 - wx) + c22[c] * wx;
+            result[c] = (top * (256 - wy) + bottom * wy + 32768) >> 16;
+        }
+    }
+}
+
+static void WarpScalar(ImagePixel *out, int n, const ImageWarpSource *src,
+                       float x, float y, float dx, float dy, bool bilinear)
+{
+    WarpSpan(out, 0, n, src, x, y, dx, dy, bilinear);
+}
+
+static void LutScalar(ImagePixel *p, int n, const quint32 *table)
+{
+    quint32 *rgba = (quint32 *)p;
+    for (int x = 0; x < n; x++) {
+        rgba[x] = table[p[x].r] | table[256 + p[x].g] | table[512 + p[x].b] | table[768 + p[x].a];
+    }
+}
+
+static void AccumulateScalar(qint32 *acc, const ImagePixel *p, int n, int weight)
+{
+    const uchar *c = &p->r;
+    for (int i = 0; i < 4 * n; i++) {
+        acc[i] += weight * c[i];
+    }
+}
+
+static void AccumulateSumsScalar(qint32 *acc, const qint32 *sums, int n, int weight)
+{
+    for (int i = 0; i < 4 * n; i++) {
+        acc[i] += weight * sums[i];
+    }
+}
+
+static void PackScalar(ImagePixel *p, int n, const qint32 *acc, int shift)
+{
+    int round = (1 << shift) >> 1;
+    uchar *c = &p->r;
+    for (int i = 0; i < 4 * n; i++) {
+        c[i] = qBound(0, (acc[i] + round) >> shift, 255);
+    }
+}
+
+static void ButterflyScalar(float *are, float *aim, float *bre, float *bim, int n, float wre, float wim)
+{
+    for (int i = 0; i < n; i++) {
+        float tre = bre[i] * wre - bim[i] * wim, tim = bre[i] * wim + bim[i] * wre;
+        bre[i] = are[i] - tre;
+        bim[i] = aim[i] - tim;
+        are[i] = are[i] + tre;
+        aim[i] = aim[i] + tim;
+    }
+}
+
+static inline int MaskLuminance(const ImagePixel &p)
+{
+    return (p.r * MASK_R + p.g * MASK_G + p.b * MASK_B + 128) >> 8;
+}
+
+static inline int Mul255(int x, int y)
+{
+    int t = x * y + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static void PremultiplyScalar(ImagePixel *out, const ImagePixel *p, const ImagePixel *mask, int n)
+{
+    for (int x = 0; x < n; x++) {
+        int m = mask ? MaskLuminance(mask[x]) : 255;
+        int a = Mul255(p[x].a, m);
+        out[x].r = Mul255(p[x].r, a);
+        out[x].g = Mul255(p[x].g, a);
+        out[x].b = Mul255(p[x].b, a);
+        out[x].a = a;
+    }
+}
+
+// Which alpha the factors Fa and Fb of an operation use, and whether as alpha or 1 - alpha
+typedef struct {
+    bool fa_alpha, fa_invert, fb_alpha;
+} CompositeFactors;
+
+static const CompositeFactors compositeFactors[IMAGE_COMPOSITE_OPERATIONS] = {
+    { false, false, true }, // over: Fa = 1, Fb = 1 - alpha s
+    { true, false, false }, // in: Fa = alpha d, Fb = 0
+    { true, true, false },  // out: Fa = 1 - alpha d, Fb = 0
+    { true, false, true }   // atop: Fa = alpha d, Fb = 1 - alpha s
+};
+
+static void CompositeScalar(ImagePixel *d, const ImagePixel *s, int n, int operation)
+{
+    const CompositeFactors &f = compositeFactors[operation];
+    for (int x = 0; x < n; x++) {
+        int fa = f.fa_alpha ? (f.fa_invert ? 255 - d[x].a : d[x].a) : 255;
+        int fb = f.fb_alpha ? 255 - s[x].a : 0;
+        const uchar *sc = &s[x].r;
+        uchar *dc = &d[x].r;
+        for (int c = 0; c < 4; c++) {
+            dc[c] = qMin(255, Mul255(sc[c], fa) + Mul255(dc[c], fb));
+        }
+    }
+}
+
+static void UnpremultiplyScalar(ImagePixel *p, int n)
+{
+    for (int x = 0; x < n; x++) {
+        int a = p[x].a;
+        if (a == 0) {
+            p[x].r = p[x].g = p[x].b = 0;
+            continue;
+        }
+        p[x].r = qMin(255, (p[x].r * 255 + a / 2) / a);
+        p[x].g = qMin(255, (p[x].g * 255 + a / 2) / a);
+        p[x].b = qMin(255, (p[x].b * 255 + a / 2) / a);
+    }
+}
+
+static void LuminanceScalar(uchar *lum, const ImagePixel *p, int n)
+{
+    for (int i = 0; i < n; i++) {
+        lum[i] = MaskLuminance(p[i]);
+    }
+}
+
+static void BilateralScalar(ImagePixel *out, const ImagePixel *p, const uchar *lum, int n, int step, int radius,
+                            const int *weights)
+{
+    for (int i = 0; i < n; i++) {
+        int center = lum[i];
+        int r = 0, g = 0, b = 0, total = 0;
+        for (int k = -radius; k <= radius; k++) {
+            const ImagePixel &q = p[i + k * step];
+            int w = weights[qAbs(k) * 256 + qAbs(lum[i + k * step] - center)];
+            r += w * q.r;
+            g += w * q.g;
+            b += w * q.b;
+            total += w;
+        }
+        float inverse = 1.0f / total;
+        out[i].r = (uchar)(r * inverse + 0.5f);
+        out[i].g = (uchar)(g * inverse + 0.5f);
+        out[i].b = (uchar)(b * inverse + 0.5f);
+        out[i].a = p[i].a;
+    }
+}
+
+static const ImageSimdKernels scalarKernels = {
+    "scalar", ScaleScalar, MixScalar, MaskScalar, HistogramScalar, WarpScalar, LutScalar,
+    AccumulateScalar, AccumulateSumsScalar, PackScalar, ButterflyScalar,
+    PremultiplyScalar, CompositeScalar, UnpremultiplyScalar, LuminanceScalar, BilateralScalar
+};
+
+
+#ifdef IMAGE_SIMD_X86
+
+/*
+SSE4.1 kernels: 8 pixels per iteration
+*/
+
+IMAGE_TARGET("sse4.1")
+static inline __m128i Widen(__m128i v, int pixel)
+{
+    switch (pixel) {
+    case 0: return _mm_cvtepu8_epi32(v);
+    case 1: return _mm_cvtepu8_epi32(_mm_srli_si128(v, 4));
+    case 2: return _mm_cvtepu8_epi32(_mm_srli_si128(v, 8));
+    default: return _mm_cvtepu8_epi32(_mm_srli_si128(v, 12));
+    }
+}
+
+// Pack four pixels of 32-bit channels back to bytes, saturating to [0, 255]
+IMAGE_TARGET("sse4.1")
+static inline __m128i Narrow(__m128i p0, __m128i p1, __m128i p2, __m128i p3)
+{
+    return _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+}
+
+// Scale works on 16-bit channels. The 17-bit factor is split as whole * 65536 + frac,
+// then (v * factor + 32768) >> 16 = v * whole + ((v * frac) >> 16) + ((v * frac) >> 15 & 1)
+IMAGE_TARGET("sse4.1")
+static inline __m128i ScaleChannels(__m128i v, __m128i whole, __m128i frac)
+{
+    __m128i carry = _mm_srli_epi16(_mm_mullo_epi16(v, frac), 15);
+    return _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(v, whole), _mm_mulhi_epu16(v, frac)), carry);
+}
+
+IMAGE_TARGET("sse4.1")
+static void ScaleSse41(ImagePixel *p, int n, int factor)
+{
+    // Alpha is multiplied by exactly 1
+    const __m128i whole = _mm_setr_epi16(factor >> 16, factor >> 16, factor >> 16, 1,
+                                         factor >> 16, factor >> 16, factor >> 16, 1);
+    const __m128i frac = _mm_setr_epi16(factor & 0xffff, factor & 0xffff, factor & 0xffff, 0,
+                                        factor & 0xffff, factor & 0xffff, factor & 0xffff, 0);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        for (int k = 0; k < 8; k += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + x + k));
+            __m128i lo = ScaleChannels(_mm_cvtepu8_epi16(v), whole, frac);
+            __m128i hi = ScaleChannels(_mm_cvtepu8_epi16(_mm_srli_si128(v, 8)), whole, frac);
+            _mm_storeu_si128((__m128i *)(p + x + k), _mm_packus_epi16(lo, hi));
+        }
+    }
+    ScaleScalar(p + x, n - x, factor);
+}
+
+IMAGE_TARGET("sse4.1")
+static void MixSse41(ImagePixel *p, int n, int factor, int lum)
+{
+    const __m128i f = _mm_set1_epi32(factor);
+    const __m128i w = _mm_setr_epi32(LUM_R, LUM_G, LUM_B, 0);
+    const __m128i round8 = _mm_set1_epi32(128);
+    const __m128i round20 = _mm_set1_epi32(1 << 19);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        for (int k = 0; k < 8; k += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + x + k));
+            __m128i c[4];
+            for (int i = 0; i < 4; i++) {
+                c[i] = Widen(v, i);
+            }
+            // Luminance of the four pixels, one per lane
+            __m128i l;
+            if (lum >= 0) {
+                l = _mm_set1_epi32(lum);
+            } else {
+                __m128i h01 = _mm_hadd_epi32(_mm_mullo_epi32(c[0], w), _mm_mullo_epi32(c[1], w));
+                __m128i h23 = _mm_hadd_epi32(_mm_mullo_epi32(c[2], w), _mm_mullo_epi32(c[3], w));
+                l = _mm_srai_epi32(_mm_add_epi32(_mm_hadd_epi32(h01, h23), round8), 8);
+            }
+            __m128i q[4];
+            for (int i = 0; i < 4; i++) {
+                __m128i li;
+                switch (i) {
+                case 0: li = _mm_shuffle_epi32(l, 0x00); break;
+                case 1: li = _mm_shuffle_epi32(l, 0x55); break;
+                case 2: li = _mm_shuffle_epi32(l, 0xaa); break;
+                default: li = _mm_shuffle_epi32(l, 0xff); break;
+                }
+                __m128i d = _mm_sub_epi32(_mm_slli_epi32(c[i], 8), li);
+                __m128i t = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(li, 12), _mm_mullo_epi32(d, f)), round20);
+                q[i] = _mm_srai_epi32(t, 20);
+            }
+            // Keep the original alpha
+            __m128i out = _mm_blendv_epi8(Narrow(q[0], q[1], q[2], q[3]), v, alpha);
+            _mm_storeu_si128((__m128i *)(p + x + k), out);
+        }
+    }
+    MixScalar(p + x, n - x, factor, lum);
+}
+
+IMAGE_TARGET("sse4.1")
+static void MaskSse41(ImagePixel *p, int n, quint32 mask)
+{
+    const __m128i m = _mm_set1_epi32((int)mask);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(p + x));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(p + x + 4));
+        _mm_storeu_si128((__m128i *)(p + x), _mm_and_si128(v0, m));
+        _mm_storeu_si128((__m128i *)(p + x + 4), _mm_and_si128(v1, m));
+    }
+    MaskScalar(p + x, n - x, mask);
+}
+
+IMAGE_TARGET("sse4.1")
+static void HistogramSse41(quint16 *h, const quint16 *add, const quint16 *sub, int n)
+{
+    for (int i = 0; i < n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(h + i));
+        v = _mm_add_epi16(v, _mm_loadu_si128((const __m128i *)(add + i)));
+        v = _mm_sub_epi16(v, _mm_loadu_si128((const __m128i *)(sub + i)));
+        _mm_storeu_si128((__m128i *)(h + i), v);
+    }
+}
+
+IMAGE_TARGET("sse4.1")
+static void AccumulateSse41(qint32 *acc, const ImagePixel *p, int n, int weight)
+{
+    const __m128i w = _mm_set1_epi32(weight);
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + x));
+        for (int i = 0; i < 4; i++) {
+            __m128i *a = (__m128i *)(acc + 4 * (x + i));
+            _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_mullo_epi32(Widen(v, i), w)));
+        }
+    }
+    AccumulateScalar(acc + 4 * x, p + x, n - x, weight);
+}
+
+IMAGE_TARGET("sse4.1")
+static void AccumulateSumsSse41(qint32 *acc, const qint32 *sums, int n, int weight)
+{
+    const __m128i w = _mm_set1_epi32(weight);
+    for (int x = 0; x < n; x++) {
+        __m128i *a = (__m128i *)(acc + 4 * x);
+        __m128i s = _mm_loadu_si128((const __m128i *)(sums + 4 * x));
+        _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_mullo_epi32(s, w)));
+    }
+}
+
+IMAGE_TARGET("sse4.1")
+static void PackSse41(ImagePixel *p, int n, const qint32 *acc, int shift)
+{
+    const __m128i round = _mm_set1_epi32((1 << shift) >> 1);
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        __m128i q[4];
+        for (int i = 0; i < 4; i++) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(acc + 4 * (x + i)));
+            q[i] = _mm_sra_epi32(_mm_add_epi32(a, round), count);
+        }
+        _mm_storeu_si128((__m128i *)(p + x), Narrow(q[0], q[1], q[2], q[3]));
+    }
+    PackScalar(p + x, n - x, acc + 4 * x, shift);
+}
+
+IMAGE_TARGET("sse4.1")
+static void ButterflySse41(float *are, float *aim, float *bre, float *bim, int n, float wre, float wim)
+{
+    const __m128 wr = _mm_set1_ps(wre), wi = _mm_set1_ps(wim);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 ar = _mm_loadu_ps(are + i), ai = _mm_loadu_ps(aim + i);
+        __m128 br = _mm_loadu_ps(bre + i), bi = _mm_loadu_ps(bim + i);
+        __m128 tr = _mm_sub_ps(_mm_mul_ps(br, wr), _mm_mul_ps(bi, wi));
+        __m128 ti = _mm_add_ps(_mm_mul_ps(br, wi), _mm_mul_ps(bi, wr));
+        _mm_storeu_ps(bre + i, _mm_sub_ps(ar, tr));
+        _mm_storeu_ps(bim + i, _mm_sub_ps(ai, ti));
+        _mm_storeu_ps(are + i, _mm_add_ps(ar, tr));
+        _mm_storeu_ps(aim + i, _mm_add_ps(ai, ti));
+    }
+    ButterflyScalar(are + i, aim + i, bre + i, bim + i, n - i, wre, wim);
+}
+
+// Premultiply, Composite and Unpremultiply work on two pixels of 16-bit channels.
+// mul255(x, y) of each channel, for x, y <= 255
+IMAGE_TARGET("sse4.1")
+static inline __m128i Mul255x16(__m128i x, __m128i y)
+{
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, y), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// The alpha of each of the two pixels in all four of its channels
+IMAGE_TARGET("sse4.1")
+static inline __m128i AlphaX16(__m128i v)
+{
+    return _mm_shuffle_epi8(v, _mm_setr_epi8(6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15));
+}
+
+IMAGE_TARGET("sse4.1")
+static inline __m128i PremultiplyX16(__m128i v, __m128i m)
+{
+    // Alpha is scaled by the mask, red, green and blue by the new alpha
+    __m128i a = Mul255x16(AlphaX16(v), m);
+    return Mul255x16(v, _mm_blend_epi16(a, m, 0x88));
+}
+
+IMAGE_TARGET("sse4.1")
+static void PremultiplySse41(ImagePixel *out, const ImagePixel *p, const ImagePixel *mask, int n)
+{
+    const __m128i weights = _mm_setr_epi16(MASK_R, MASK_G, MASK_B, 0, MASK_R, MASK_G, MASK_B, 0);
+    const __m128i spread = _mm_setr_epi8(0, 1, 0, 1, 0, 1, 0, 1, 4, 5, 4, 5, 4, 5, 4, 5);
+    __m128i m = _mm_set1_epi16(255);
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + x));
+        __m128i q[2];
+        for (int k = 0; k < 2; k++) {
+            if (mask) {
+                // Luminance of the two mask pixels, spread over their channels
+                __m128i c = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(mask + x + 2 * k)));
+                __m128i sums = _mm_madd_epi16(c, weights);
+                __m128i l = _mm_srli_epi32(_mm_add_epi32(_mm_hadd_epi32(sums, sums), _mm_set1_epi32(128)), 8);
+                m = _mm_shuffle_epi8(l, spread);
+            }
+            q[k] = PremultiplyX16(_mm_cvtepu8_epi16(k ? _mm_srli_si128(v, 8) : v), m);
+        }
+        _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(q[0], q[1]));
+    }
+    PremultiplyScalar(out + x, p + x, mask ? mask + x : NULL, n - x);
+}
+
+// Fa and Fb as (alpha & use) ^ invert, where invert 255 turns alpha into 1 - alpha and
+// turns 0 into 1
+static inline void CompositeMasks(int operation, short *fa_use, short *fa_invert, short *fb_use, short *fb_invert)
+{
+    const CompositeFactors &f = compositeFactors[operation];
+    *fa_use = f.fa_alpha ? -1 : 0;
+    *fa_invert = f.fa_alpha && !f.fa_invert ? 0 : 255;
+    *fb_use = f.fb_alpha ? -1 : 0;
+    *fb_invert = f.fb_alpha ? 255 : 0;
+}
+
+IMAGE_TARGET("sse4.1")
+static void CompositeSse41(ImagePixel *d, const ImagePixel *s, int n, int operation)
+{
+    short fa_use, fa_invert, fb_use, fb_invert;
+    CompositeMasks(operation, &fa_use, &fa_invert, &fb_use, &fb_invert);
+    const __m128i au = _mm_set1_epi16(fa_use), ai = _mm_set1_epi16(fa_invert);
+    const __m128i bu = _mm_set1_epi16(fb_use), bi = _mm_set1_epi16(fb_invert);
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        __m128i dv = _mm_loadu_si128((const __m128i *)(d + x));
+        __m128i sv = _mm_loadu_si128((const __m128i *)(s + x));
+        __m128i q[2];
+        for (int k = 0; k < 2; k++) {
+            __m128i dc = _mm_cvtepu8_epi16(k ? _mm_srli_si128(dv, 8) : dv);
+            __m128i sc = _mm_cvtepu8_epi16(k ? _mm_srli_si128(sv, 8) : sv);
+            __m128i fa = _mm_xor_si128(_mm_and_si128(AlphaX16(dc), au), ai);
+            __m128i fb = _mm_xor_si128(_mm_and_si128(AlphaX16(sc), bu), bi);
+            q[k] = _mm_add_epi16(Mul255x16(sc, fa), Mul255x16(dc, fb));
+        }
+        _mm_storeu_si128((__m128i *)(d + x), _mm_packus_epi16(q[0], q[1]));
+    }
+    CompositeScalar(d + x, s + x, n - x, operation);
+}
+
+// Unpremultiply divides in single precision: the quotients are below 256 and at least
+// 1 / 255 away from the next integer unless they are one, so truncating the rounded
+// quotient gives the integer division's result
+IMAGE_TARGET("sse4.1")
+static void UnpremultiplySse41(ImagePixel *p, int n)
+{
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + x));
+        __m128i q[4];
+        for (int i = 0; i < 4; i++) {
+            __m128i c = Widen(v, i);
+            __m128i a = _mm_shuffle_epi32(c, 0xff);
+            __m128 num = _mm_cvtepi32_ps(_mm_add_epi32(_mm_mullo_epi32(c, _mm_set1_epi32(255)), _mm_srli_epi32(a, 1)));
+            __m128i quotient = _mm_cvttps_epi32(_mm_div_ps(num, _mm_cvtepi32_ps(a)));
+            // Zero alpha divides by zero; those pixels become zero
+            q[i] = _mm_andnot_si128(_mm_cmpeq_epi32(a, _mm_setzero_si128()), quotient);
+        }
+        _mm_storeu_si128((__m128i *)(p + x), _mm_blendv_epi8(Narrow(q[0], q[1], q[2], q[3]), v, alpha));
+    }
+    UnpremultiplyScalar(p + x, n - x);
+}
+
+IMAGE_TARGET("sse4.1")
+static void LuminanceSse41(uchar *lum, const ImagePixel *p, int n)
+{
+    const __m128i weights = _mm_setr_epi16(MASK_R, MASK_G, MASK_B, 0, MASK_R, MASK_G, MASK_B, 0);
+    const __m128i round = _mm_set1_epi32(128);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(p + x)), v1 = _mm_loadu_si128((const __m128i *)(p + x + 4));
+        // Two 32-bit halves of each pixel's sum, added pairwise
+        __m128i s0 = _mm_hadd_epi32(_mm_madd_epi16(_mm_cvtepu8_epi16(v0), weights),
+                                    _mm_madd_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(v0, 8)), weights));
+        __m128i s1 = _mm_hadd_epi32(_mm_madd_epi16(_mm_cvtepu8_epi16(v1), weights),
+                                    _mm_madd_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(v1, 8)), weights));
+        s0 = _mm_srli_epi32(_mm_add_epi32(s0, round), 8);
+        s1 = _mm_srli_epi32(_mm_add_epi32(s1, round), 8);
+        _mm_storel_epi64((__m128i *)(lum + x), _mm_packus_epi16(_mm_packs_epi32(s0, s1), _mm_setzero_si128()));
+    }
+    LuminanceScalar(lum + x, p + x, n - x);
+}
+
+// Warp, Lut and Bilateral are dominated by loading scattered values, which only AVX2 can
+// vectorize
+static const ImageSimdKernels sse41Kernels = {
+    "sse4.1", ScaleSse41, MixSse41, MaskSse41, HistogramSse41, WarpScalar, LutScalar,
+    AccumulateSse41, AccumulateSumsSse41, PackSse41, ButterflySse41,
+    PremultiplySse41, CompositeSse41, UnpremultiplySse41, LuminanceSse41, BilateralScalar
+};
+
+
+/*
+AVX2 kernels: 8 or 16 pixels per iteration. The remainders go to the scalar kernels,
+which are SSE code: the upper halves of the registers are cleared first, because GCC
+leaves out vzeroupper before a tail call and every SSE instruction after 256-bit code
+with dirty upper halves pays a state transition
+*/
+
+// Pixels 2i and 2i+1 of the eight at p, one per 128-bit lane
+IMAGE_TARGET("avx2")
+static inline __m256i Widen2(const ImagePixel *p, int i)
+{
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(p + 2 * i)));
+}
+
+// Pack eight pixels produced by Widen2 back to bytes, saturating to [0, 255]
+IMAGE_TARGET("avx2")
+static inline __m256i Narrow2(__m256i q0, __m256i q1, __m256i q2, __m256i q3)
+{
+    // The packs interleave the lanes as 0 2 4 6 | 1 3 5 7
+    __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(q0, q1), _mm256_packs_epi32(q2, q3));
+    return _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+IMAGE_TARGET("avx2")
+static inline __m256i ScaleChannels2(__m256i v, __m256i whole, __m256i frac)
+{
+    __m256i carry = _mm256_srli_epi16(_mm256_mullo_epi16(v, frac), 15);
+    return _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(v, whole), _mm256_mulhi_epu16(v, frac)), carry);
+}
+
+IMAGE_TARGET("avx2")
+static void ScaleAvx2(ImagePixel *p, int n, int factor)
+{
+    // Alpha is multiplied by exactly 1
+    const __m256i whole = _mm256_set1_epi64x(((long long)1 << 48) | ((long long)(factor >> 16) * 0x100010001LL));
+    const __m256i frac = _mm256_set1_epi64x((long long)(factor & 0xffff) * 0x100010001LL);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i lo = ScaleChannels2(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + x))), whole, frac);
+        __m256i hi = ScaleChannels2(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + x + 4))), whole, frac);
+        // packus interleaves the 128-bit lanes, put them back in order
+        __m256i packed = _mm256_packus_epi16(lo, hi);
+        _mm256_storeu_si256((__m256i *)(p + x), _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+    _mm256_zeroupper();
+    ScaleScalar(p + x, n - x, factor);
+}
+
+IMAGE_TARGET("avx2")
+static void MixAvx2(ImagePixel *p, int n, int factor, int lum)
+{
+    const __m256i f = _mm256_set1_epi32(factor);
+    const __m256i w = _mm256_setr_epi32(LUM_R, LUM_G, LUM_B, 0, LUM_R, LUM_G, LUM_B, 0);
+    const __m256i round8 = _mm256_set1_epi32(128);
+    const __m256i round20 = _mm256_set1_epi32(1 << 19);
+    const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i c[4];
+        for (int i = 0; i < 4; i++) {
+            c[i] = Widen2(p + x, i);
+        }
+        // Luminance of pixels 0 2 4 6 in the low lane and 1 3 5 7 in the high lane
+        __m256i l;
+        if (lum >= 0) {
+            l = _mm256_set1_epi32(lum);
+        } else {
+            __m256i h01 = _mm256_hadd_epi32(_mm256_mullo_epi32(c[0], w), _mm256_mullo_epi32(c[1], w));
+            __m256i h23 = _mm256_hadd_epi32(_mm256_mullo_epi32(c[2], w), _mm256_mullo_epi32(c[3], w));
+            l = _mm256_srai_epi32(_mm256_add_epi32(_mm256_hadd_epi32(h01, h23), round8), 8);
+        }
+        __m256i q[4];
+        for (int i = 0; i < 4; i++) {
+            __m256i li;
+            switch (i) {
+            case 0: li = _mm256_shuffle_epi32(l, 0x00); break;
+            case 1: li = _mm256_shuffle_epi32(l, 0x55); break;
+            case 2: li = _mm256_shuffle_epi32(l, 0xaa); break;
+            default: li = _mm256_shuffle_epi32(l, 0xff); break;
+            }
+            __m256i d = _mm256_sub_epi32(_mm256_slli_epi32(c[i], 8), li);
+            __m256i t = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(li, 12), _mm256_mullo_epi32(d, f)), round20);
+            q[i] = _mm256_srai_epi32(t, 20);
+        }
+        // Keep the original alpha
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + x));
+        _mm256_storeu_si256((__m256i *)(p + x), _mm256_blendv_epi8(Narrow2(q[0], q[1], q[2], q[3]), v, alpha));
+    }
+    _mm256_zeroupper();
+    MixScalar(p + x, n - x, factor, lum);
+}
+
+IMAGE_TARGET("avx2")
+static void MaskAvx2(ImagePixel *p, int n, quint32 mask)
+{
+    const __m256i m = _mm256_set1_epi32((int)mask);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(p + x));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + x + 8));
+        _mm256_storeu_si256((__m256i *)(p + x), _mm256_and_si256(v0, m));
+        _mm256_storeu_si256((__m256i *)(p + x + 8), _mm256_and_si256(v1, m));
+    }
+    _mm256_zeroupper();
+    MaskScalar(p + x, n - x, mask);
+}
+
+IMAGE_TARGET("avx2")
+static void HistogramAvx2(quint16 *h, const quint16 *add, const quint16 *sub, int n)
+{
+    for (int i = 0; i < n; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(h + i));
+        v = _mm256_add_epi16(v, _mm256_loadu_si256((const __m256i *)(add + i)));
+        v = _mm256_sub_epi16(v, _mm256_loadu_si256((const __m256i *)(sub + i)));
+        _mm256_storeu_si256((__m256i *)(h + i), v);
+    }
+}
+
+// Reflects coordinates about 0 and n - 1 like ImageBorderIndex: t = v mod 2 (n - 1) is
+// the distance along one period, folded back past n - 1. In single precision, which is
+// exact for coordinates below 2^24
+IMAGE_TARGET("avx2")
+static inline __m256i WarpMirror(__m256i v, int n)
+{
+    const __m256 period = _mm256_set1_ps((float)qMax(2 * (n - 1), 1));
+    __m256 f = _mm256_cvtepi32_ps(v);
+    __m256 t = _mm256_sub_ps(f, _mm256_mul_ps(period, _mm256_floor_ps(_mm256_div_ps(f, period))));
+    return _mm256_cvttps_epi32(_mm256_min_ps(t, _mm256_sub_ps(period, t)));
+}
+
+// Gathers the pixels at integer coordinates (x, y) like WarpTap. Every lane reads inside
+// the image or its apron, so the gather needs no mask
+IMAGE_TARGET("avx2")
+static inline __m256i WarpGather(const ImageWarpSource *src, __m256i x, __m256i y)
+{
+    if (src->border == IMAGE_BORDER_MIRROR) {
+        x = WarpMirror(x, src->width);
+        y = WarpMirror(y, src->height);
+    }
+    const __m256i low = _mm256_set1_epi32(-1);
+    x = _mm256_max_epi32(_mm256_min_epi32(x, _mm256_set1_epi32(src->width)), low);
+    y = _mm256_max_epi32(_mm256_min_epi32(y, _mm256_set1_epi32(src->height)), low);
+    __m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(y, _mm256_set1_epi32(src->stride)), x);
+    return _mm256_i32gather_epi32((const int *)src->pixels, offset, 4);
+}
+
+IMAGE_TARGET("avx2")
+static void WarpAvx2(ImagePixel *out, int n, const ImageWarpSource *src,
+                     float x, float y, float dx, float dy, bool bilinear)
+{
+    const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 vx = _mm256_set1_ps(x), vy = _mm256_set1_ps(y),
+                 vdx = _mm256_set1_ps(dx), vdy = _mm256_set1_ps(dy);
+    const __m256 half = _mm256_set1_ps(0.5f), scale = _mm256_set1_ps(256);
+    const __m256i one = _mm256_set1_epi32(1), full = _mm256_set1_epi32(256),
+                  byte = _mm256_set1_epi32(0xff), round = _mm256_set1_epi32(32768);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 index = _mm256_add_ps(_mm256_set1_ps((float)i), lane);
+        __m256 fx = _mm256_add_ps(vx, _mm256_mul_ps(index, vdx)),
+               fy = _mm256_add_ps(vy, _mm256_mul_ps(index, vdy));
+        if (!bilinear) {
+            __m256i px = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(fx, half))),
+                    py = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(fy, half)));
+            _mm256_storeu_si256((__m256i *)(out + i), WarpGather(src, px, py));
+            continue;
+        }
+        __m256 x1 = _mm256_floor_ps(fx), y1 = _mm256_floor_ps(fy);
+        __m256i wx = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(fx, x1), scale), half)),
+                wy = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(fy, y1), scale), half));
+        __m256i ix = _mm256_cvttps_epi32(x1), iy = _mm256_cvttps_epi32(y1);
+        __m256i q11 = WarpGather(src, ix, iy),
+                q21 = WarpGather(src, _mm256_add_epi32(ix, one), iy),
+                q12 = WarpGather(src, ix, _mm256_add_epi32(iy, one)),
+                q22 = WarpGather(src, _mm256_add_epi32(ix, one), _mm256_add_epi32(iy, one));
+        __m256i wx0 = _mm256_sub_epi32(full, wx), wy0 = _mm256_sub_epi32(full, wy);
+        __m256i result = _mm256_setzero_si256();
+        for (int c = 0; c < 32; c += 8) {
+            __m256i top = _mm256_add_epi32(
+                _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(q11, c), byte), wx0),
+                _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(q21, c), byte), wx));
+            __m256i bottom = _mm256_add_epi32(
+                _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(q12, c), byte), wx0),
+                _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(q22, c), byte), wx));
+            __m256i channel = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(
+                _mm256_mullo_epi32(top, wy0), _mm256_mullo_epi32(bottom, wy)), round), 16);
+            result = _mm256_or_si256(result, _mm256_slli_epi32(channel, c));
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), result);
+    }
+    WarpSpan(out, i, n, src, x, y, dx, dy, bilinear);
+}
+
+// Four gathers look up the four channels of eight pixels
+IMAGE_TARGET("avx2")
+static void LutAvx2(ImagePixel *p, int n, const quint32 *table)
+{
+    const __m256i low = _mm256_set1_epi32(0xff);
+    const int *t = (const int *)table;
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + x));
+        __m256i r = _mm256_i32gather_epi32(t, _mm256_and_si256(v, low), 4);
+        __m256i g = _mm256_i32gather_epi32(t + 256, _mm256_and_si256(_mm256_srli_epi32(v, 8), low), 4);
+        __m256i b = _mm256_i32gather_epi32(t + 512, _mm256_and_si256(_mm256_srli_epi32(v, 16), low), 4);
+        __m256i a = _mm256_i32gather_epi32(t + 768, _mm256_srli_epi32(v, 24), 4);
+        _mm256_storeu_si256((__m256i *)(p + x), _mm256_or_si256(_mm256_or_si256(r, g), _mm256_or_si256(b, a)));
+    }
+    _mm256_zeroupper();
+    LutScalar(p + x, n - x, table);
+}
+
+IMAGE_TARGET("avx2")
+static void AccumulateAvx2(qint32 *acc, const ImagePixel *p, int n, int weight)
+{
+    const __m256i w = _mm256_set1_epi32(weight);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        for (int i = 0; i < 4; i++) {
+            __m256i *a = (__m256i *)(acc + 4 * (x + 2 * i));
+            _mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a), _mm256_mullo_epi32(Widen2(p + x, i), w)));
+        }
+    }
+    _mm256_zeroupper();
+    AccumulateScalar(acc + 4 * x, p + x, n - x, weight);
+}
+
+IMAGE_TARGET("avx2")
+static void AccumulateSumsAvx2(qint32 *acc, const qint32 *sums, int n, int weight)
+{
+    const __m256i w = _mm256_set1_epi32(weight);
+    int x = 0;
+    for (; x + 2 <= n; x += 2) {
+        __m256i *a = (__m256i *)(acc + 4 * x);
+        __m256i s = _mm256_loadu_si256((const __m256i *)(sums + 4 * x));
+        _mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a), _mm256_mullo_epi32(s, w)));
+    }
+    _mm256_zeroupper();
+    AccumulateSumsScalar(acc + 4 * x, sums + 4 * x, n - x, weight);
+}
+
+IMAGE_TARGET("avx2")
+static void PackAvx2(ImagePixel *p, int n, const qint32 *acc, int shift)
+{
+    const __m256i round = _mm256_set1_epi32((1 << shift) >> 1);
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        // Pixels 2i and 2i+1 as Widen2 would have loaded them
+        __m256i q[4];
+        for (int i = 0; i < 4; i++) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(acc + 4 * (x + 2 * i)));
+            q[i] = _mm256_sra_epi32(_mm256_add_epi32(a, round), count);
+        }
+        _mm256_storeu_si256((__m256i *)(p + x), Narrow2(q[0], q[1], q[2], q[3]));
+    }
+    _mm256_zeroupper();
+    PackScalar(p + x, n - x, acc + 4 * x, shift);
+}
+
+IMAGE_TARGET("avx2")
+static void ButterflyAvx2(float *are, float *aim, float *bre, float *bim, int n, float wre, float wim)
+{
+    const __m256 wr = _mm256_set1_ps(wre), wi = _mm256_set1_ps(wim);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 ar = _mm256_loadu_ps(are + i), ai = _mm256_loadu_ps(aim + i);
+        __m256 br = _mm256_loadu_ps(bre + i), bi = _mm256_loadu_ps(bim + i);
+        __m256 tr = _mm256_sub_ps(_mm256_mul_ps(br, wr), _mm256_mul_ps(bi, wi));
+        __m256 ti = _mm256_add_ps(_mm256_mul_ps(br, wi), _mm256_mul_ps(bi, wr));
+        _mm256_storeu_ps(bre + i, _mm256_sub_ps(ar, tr));
+        _mm256_storeu_ps(bim + i, _mm256_sub_ps(ai, ti));
+        _mm256_storeu_ps(are + i, _mm256_add_ps(ar, tr));
+        _mm256_storeu_ps(aim + i, _mm256_add_ps(ai, ti));
+    }
+    _mm256_zeroupper();
+    ButterflyScalar(are + i, aim + i, bre + i, bim + i, n - i, wre, wim);
+}
+
+// Four pixels of 16-bit channels, two per 128-bit lane, in the same order as the SSE4.1
+// versions
+IMAGE_TARGET("avx2")
+static inline __m256i Mul255x16x2(__m256i x, __m256i y)
+{
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(x, y), _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+IMAGE_TARGET("avx2")
+static inline __m256i AlphaX16x2(__m256i v)
+{
+    return _mm256_shuffle_epi8(v, _mm256_setr_epi8(6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15,
+                                                   6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15));
+}
+
+// Eight pixels widened to 16 bits: 0-3 in lo and 4-7 in hi
+IMAGE_TARGET("avx2")
+static inline void WidenX16x2(const ImagePixel *p, __m256i *lo, __m256i *hi)
+{
+    *lo = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)p));
+    *hi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + 4)));
+}
+
+// Packs what WidenX16x2 produced back to eight pixels, saturating to [0, 255]
+IMAGE_TARGET("avx2")
+static inline void NarrowX16x2(ImagePixel *p, __m256i lo, __m256i hi)
+{
+    // packus interleaves the 128-bit lanes, put them back in order
+    _mm256_storeu_si256((__m256i *)p, _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8));
+}
+
+IMAGE_TARGET("avx2")
+static void PremultiplyAvx2(ImagePixel *out, const ImagePixel *p, const ImagePixel *mask, int n)
+{
+    const __m256i weights = _mm256_setr_epi16(MASK_R, MASK_G, MASK_B, 0, MASK_R, MASK_G, MASK_B, 0,
+                                              MASK_R, MASK_G, MASK_B, 0, MASK_R, MASK_G, MASK_B, 0);
+    const __m256i spread = _mm256_setr_epi8(0, 1, 0, 1, 0, 1, 0, 1, 4, 5, 4, 5, 4, 5, 4, 5,
+                                            0, 1, 0, 1, 0, 1, 0, 1, 4, 5, 4, 5, 4, 5, 4, 5);
+    __m256i m[2] = { _mm256_set1_epi16(255), _mm256_set1_epi16(255) };
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i v[2];
+        WidenX16x2(p + x, &v[0], &v[1]);
+        if (mask) {
+            __m256i c[2];
+            WidenX16x2(mask + x, &c[0], &c[1]);
+            for (int k = 0; k < 2; k++) {
+                __m256i sums = _mm256_madd_epi16(c[k], weights);
+                __m256i l = _mm256_srli_epi32(_mm256_add_epi32(_mm256_hadd_epi32(sums, sums), _mm256_set1_epi32(128)), 8);
+                m[k] = _mm256_shuffle_epi8(l, spread);
+            }
+        }
+        for (int k = 0; k < 2; k++) {
+            __m256i a = Mul255x16x2(AlphaX16x2(v[k]), m[k]);
+            v[k] = Mul255x16x2(v[k], _mm256_blend_epi16(a, m[k], 0x88));
+        }
+        NarrowX16x2(out + x, v[0], v[1]);
+    }
+    _mm256_zeroupper();
+    PremultiplyScalar(out + x, p + x, mask ? mask + x : NULL, n - x);
+}
+
+IMAGE_TARGET("avx2")
+static void CompositeAvx2(ImagePixel *d, const ImagePixel *s, int n, int operation)
+{
+    short fa_use, fa_invert, fb_use, fb_invert;
+    CompositeMasks(operation, &fa_use, &fa_invert, &fb_use, &fb_invert);
+    const __m256i au = _mm256_set1_epi16(fa_use), ai = _mm256_set1_epi16(fa_invert);
+    const __m256i bu = _mm256_set1_epi16(fb_use), bi = _mm256_set1_epi16(fb_invert);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i dc[2], sc[2];
+        WidenX16x2(d + x, &dc[0], &dc[1]);
+        WidenX16x2(s + x, &sc[0], &sc[1]);
+        for (int k = 0; k < 2; k++) {
+            __m256i fa = _mm256_xor_si256(_mm256_and_si256(AlphaX16x2(dc[k]), au), ai);
+            __m256i fb = _mm256_xor_si256(_mm256_and_si256(AlphaX16x2(sc[k]), bu), bi);
+            dc[k] = _mm256_add_epi16(Mul255x16x2(sc[k], fa), Mul255x16x2(dc[k], fb));
+        }
+        NarrowX16x2(d + x, dc[0], dc[1]);
+    }
+    _mm256_zeroupper();
+    CompositeScalar(d + x, s + x, n - x, operation);
+}
+
+// Divides in single precision like UnpremultiplySse41
+IMAGE_TARGET("avx2")
+static void UnpremultiplyAvx2(ImagePixel *p, int n)
+{
+    const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i q[4];
+        for (int i = 0; i < 4; i++) {
+            __m256i c = Widen2(p + x, i);
+            __m256i a = _mm256_shuffle_epi32(c, 0xff);
+            __m256 num = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_mullo_epi32(c, _mm256_set1_epi32(255)),
+                                                             _mm256_srli_epi32(a, 1)));
+            __m256i quotient = _mm256_cvttps_epi32(_mm256_div_ps(num, _mm256_cvtepi32_ps(a)));
+            q[i] = _mm256_andnot_si256(_mm256_cmpeq_epi32(a, _mm256_setzero_si256()), quotient);
+        }
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + x));
+        _mm256_storeu_si256((__m256i *)(p + x), _mm256_blendv_epi8(Narrow2(q[0], q[1], q[2], q[3]), v, alpha));
+    }
+    _mm256_zeroupper();
+    UnpremultiplyScalar(p + x, n - x);
+}
+
+IMAGE_TARGET("avx2")
+static void LuminanceAvx2(uchar *lum, const ImagePixel *p, int n)
+{
+    const __m256i weights = _mm256_setr_epi16(MASK_R, MASK_G, MASK_B, 0, MASK_R, MASK_G, MASK_B, 0,
+                                              MASK_R, MASK_G, MASK_B, 0, MASK_R, MASK_G, MASK_B, 0);
+    const __m256i round = _mm256_set1_epi32(128);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m256i s[2];
+        for (int k = 0; k < 2; k++) {
+            __m256i lo, hi;
+            WidenX16x2(p + x + 8 * k, &lo, &hi);
+            // Pixels 0 1 4 5 | 2 3 6 7 of the eight
+            s[k] = _mm256_hadd_epi32(_mm256_madd_epi16(lo, weights), _mm256_madd_epi16(hi, weights));
+            s[k] = _mm256_srli_epi32(_mm256_add_epi32(s[k], round), 8);
+        }
+        // Pixels 0 1 4 5 8 9 12 13 | 2 3 6 7 10 11 14 15 as 16 bits, then in order
+        __m256i words = _mm256_packs_epi32(s[0], s[1]);
+        words = _mm256_shuffle_epi8(words, _mm256_setr_epi8(0, 1, 2, 3, 8, 9, 10, 11, 4, 5, 6, 7, 12, 13, 14, 15,
+                                                            0, 1, 2, 3, 8, 9, 10, 11, 4, 5, 6, 7, 12, 13, 14, 15));
+        // 0 1 8 9 4 5 12 13 | 2 3 10 11 6 7 14 15, so interleave the 32-bit pairs of the lanes
+        words = _mm256_permutevar8x32_epi32(words, _mm256_setr_epi32(0, 4, 2, 6, 1, 5, 3, 7));
+        __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+        _mm_storeu_si128((__m128i *)(lum + x), bytes);
+    }
+    _mm256_zeroupper();
+    LuminanceScalar(lum + x, p + x, n - x);
+}
+
+// Eight pixels per iteration, the weights of each tap gathered from the table
+IMAGE_TARGET("avx2")
+static void BilateralAvx2(ImagePixel *out, const ImagePixel *p, const uchar *lum, int n, int step, int radius,
+                          const int *weights)
+{
+    const __m256i low = _mm256_set1_epi32(0xff);
+    const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i center = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(lum + i)));
+        __m256i r = _mm256_setzero_si256(), g = r, b = r, total = r;
+        for (int k = -radius; k <= radius; k++) {
+            const int j = i + k * step;
+            __m256i l = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(lum + j)));
+            __m256i index = _mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(l, center)), _mm256_set1_epi32(qAbs(k) * 256));
+            __m256i w = _mm256_i32gather_epi32(weights, index, 4);
+            __m256i q = _mm256_loadu_si256((const __m256i *)(p + j));
+            r = _mm256_add_epi32(r, _mm256_mullo_epi32(_mm256_and_si256(q, low), w));
+            g = _mm256_add_epi32(g, _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(q, 8), low), w));
+            b = _mm256_add_epi32(b, _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(q, 16), low), w));
+            total = _mm256_add_epi32(total, w);
+        }
+        __m256 inverse = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_cvtepi32_ps(total));
+        r = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(r), inverse), half));
+        g = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(g), inverse), half));
+        b = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(b), inverse), half));
+        __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(p + i)), alpha);
+        __m256i v = _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi32(g, 8)), _mm256_or_si256(_mm256_slli_epi32(b, 16), a));
+        _mm256_storeu_si256((__m256i *)(out + i), v);
+    }
+    _mm256_zeroupper();
+    BilateralScalar(out + i, p + i, lum + i, n - i, step, radius, weights);
+}
+
+static const ImageSimdKernels avx2Kernels = {
+    "avx2", ScaleAvx2, MixAvx2, MaskAvx2, HistogramAvx2, WarpAvx2, LutAvx2,
+    AccumulateAvx2, AccumulateSumsAvx2, PackAvx2, ButterflyAvx2,
+    PremultiplyAvx2, CompositeAvx2, UnpremultiplyAvx2, LuminanceAvx2, BilateralAvx2
+};
+
+
+static bool CpuSupports(bool avx2)
+{
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    int maxLeaf = regs[0];
+    __cpuid(regs, 1);
+    bool sse41 = (regs[2] & (1 << 19)) != 0;
+    if (!avx2) {
+        return sse41;
+    }
+    // AVX needs OS support for saving the YMM registers (OSXSAVE and XCR0)
+    bool osxsave = (regs[2] & (1 << 27)) != 0;
+    if (!osxsave || (_xgetbv(0) & 6) != 6 || maxLeaf < 7) {
+        return false;
+    }
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return avx2 ? __builtin_cpu_supports("avx2") : __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+#endif // IMAGE_SIMD_X86
+
+
+static const ImageSimdKernels *DetectKernels()
+{
+#ifdef IMAGE_SIMD_X86
+    if (CpuSupports(true)) {
+        return &avx2Kernels;
+    }
+    if (CpuSupports(false)) {
+        return &sse41Kernels;
+    }
+#endif
+    return &scalarKernels;
+}
+
+
+const ImageSimdKernels *ImageSimd()
+{
+    static const ImageSimdKernels *kernels = DetectKernels();
+    return kernels;
+}
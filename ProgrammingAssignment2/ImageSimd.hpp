@@ -0,0 +1,105 @@
+#ifndef IMAGESIMD_HPP
+#define IMAGESIMD_HPP
+
+#include "Image.hpp"
+
+/*
+Kernels for per-pixel operations on spans of n pixels. Every kernel has a scalar,
+an SSE4.1 and an AVX2 implementation which produce identical results: they all
+work in the fixed-point formats below rather than in floating point.
+Alpha is never modified.
+
+Scale: value = min(255, round(value * factor / 65536))
+    used by Brightness, factor is 16.16 fixed-point
+Mix: value = clamp(round(lum + (value - lum) * factor / 4096))
+    used by Saturation and Contrast, factor is 20.12 fixed-point and lum is the
+    luminance in 24.8 fixed-point. When lum is negative the luminance of each pixel
+    (0.299 red + 0.587 green + 0.114 blue) is used instead
+Mask: pixel = pixel & mask
+    used by ChannelExtract, mask is applied to the 32 bits of each ImagePixel
+Histogram: h[i] = h[i] + add[i] - sub[i] for n 16-bit counts, wrapping modulo 65536
+    used by MedianFilter to slide histograms, n is a multiple of 16
+Warp: out[i] = source sampled at (x + i * dx, y + i * dy) for i in [0, n)
+    used by Rotate and Scale, see ImageWarpSource. Coordinates are computed in single
+    precision. Point sampling takes the pixel at floor(coordinate + 0.5); bilinear
+    sampling weights the four surrounding pixels in steps of 1/256 and rounds. Unlike
+    the other kernels, Warp writes alpha too
+Lut: pixel = table[r] | table[256 + g] | table[512 + b] | table[768 + a]
+    used by PointOps for runs of per-channel operations compiled into one table per
+    channel. Each of the 4 x 256 entries is an ImagePixel with only its own channel set,
+    so Lut writes alpha too (PointOps' tables leave it unchanged)
+Accumulate: acc[4 * i + c] += weight * channel c of p[i]
+    one tap of a convolution (see ImageConvolve.hpp) over a row of pixels, with the four
+    channels of each pixel in 32-bit sums
+AccumulateSums: acc[4 * i + c] += weight * sums[4 * i + c]
+    one tap of the horizontal pass of a separable convolution
+Pack: channel c of p[i] = clamp((acc[4 * i + c] + round) >> shift)
+    round is half of 1 << shift, so results round to nearest; like Warp and Lut, Pack
+    writes alpha too
+Butterfly: t = b[i] * w, b[i] = a[i] - t, a[i] = a[i] + t for n complex values
+    one radix-2 step of ImageFft over a run of lanes. Values are floats with the real
+    and imaginary parts in separate arrays, and every implementation does the same
+    float operations in the same order
+Premultiply: alpha' = mul255(alpha, m), c' = mul255(c, alpha') for c in red, green, blue
+    out[i] = p[i] with its alpha scaled by mask[i] and premultiplied by it, where m is
+    the mask's luminance (77 red + 150 green + 29 blue + 128) >> 8, or 255 when mask is
+    NULL. mul255(x, y) is x * y / 255 rounded to nearest. out may be p
+Composite: d[i] = min(255, mul255(s[i], Fa) + mul255(d[i], Fb)) for all four channels
+    the Porter-Duff operation (an ImageCompositeOperation) of premultiplied source s over
+    premultiplied destination d: Fa is 1, alpha d or 1 - alpha d and Fb is 1 - alpha s or 0
+Unpremultiply: c = min(255, (c * 255 + alpha / 2) / alpha), or 0 when alpha is 0
+    undoes Premultiply for red, green and blue; alpha is unchanged
+Luminance: lum[i] = (77 red + 150 green + 29 blue + 128) >> 8 of p[i]
+    the luminance Premultiply uses for masks
+Bilateral: out[i] = sum of w * p[i + k * step] / sum of w over k in [-radius, radius]
+    one pass of a separable bilateral filter over red, green and blue, used by
+    Nonphotorealism. w is weights[|k| * 256 + |lum[i + k * step] - lum[i]|], an integer;
+    the quotient is c * (1.0f / total) + 0.5f truncated, in single precision. Alpha is
+    copied from p[i]
+*/
+
+// The image sampled by the Warp kernel, whose apron holds at least one pixel of border
+// (see Image::FillApron)
+typedef struct {
+    const ImagePixel *pixels;
+    int stride, width, height;
+    ImageBorder border;
+} ImageWarpSource;
+
+/*
+The coordinate Warp reads for coordinate i of a row or column of n pixels: i mirrored
+into the image for IMAGE_BORDER_MIRROR, otherwise i clamped to the one pixel apron,
+which holds the nearest edge pixel or black
+*/
+static inline int ImageWarpCoordinate(int i, int n, ImageBorder border)
+{
+    return border == IMAGE_BORDER_MIRROR ? ImageBorderIndex(i, n, border) : qBound(-1, i, n);
+}
+
+typedef struct {
+    const char *name;
+    void (*Scale)(ImagePixel *p, int n, int factor);
+    void (*Mix)(ImagePixel *p, int n, int factor, int lum);
+    void (*Mask)(ImagePixel *p, int n, quint32 mask);
+    void (*Histogram)(quint16 *h, const quint16 *add, const quint16 *sub, int n);
+    void (*Warp)(ImagePixel *out, int n, const ImageWarpSource *src,
+                 float x, float y, float dx, float dy, bool bilinear);
+    void (*Lut)(ImagePixel *p, int n, const quint32 *table);
+    void (*Accumulate)(qint32 *acc, const ImagePixel *p, int n, int weight);
+    void (*AccumulateSums)(qint32 *acc, const qint32 *sums, int n, int weight);
+    void (*Pack)(ImagePixel *p, int n, const qint32 *acc, int shift);
+    void (*Butterfly)(float *are, float *aim, float *bre, float *bim, int n, float wre, float wim);
+    void (*Premultiply)(ImagePixel *out, const ImagePixel *p, const ImagePixel *mask, int n);
+    void (*Composite)(ImagePixel *d, const ImagePixel *s, int n, int operation);
+    void (*Unpremultiply)(ImagePixel *p, int n);
+    void (*Luminance)(uchar *lum, const ImagePixel *p, int n);
+    void (*Bilateral)(ImagePixel *out, const ImagePixel *p, const uchar *lum, int n, int step, int radius,
+                      const int *weights);
+} ImageSimdKernels;
+
+/*
+Returns the fastest kernels supported by the CPU, detected with CPUID on first use
+*/
+const ImageSimdKernels *ImageSimd();
+
+#endif
@@ -0,0 +1,277 @@
+#include "ImageStream.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef Q_OS_UNIX
+#include <sys/stat.h>
+#endif
+
+// Reads the next whitespace separated PPM or PFM header field, skipping comments
+static bool ReadHeaderField(QFile &file, char *field, int length)
+{
+    char c;
+    do {
+        if (file.read(&c, 1) != 1) {
+            return false;
+        }
+        if (c == '#') {
+            while (c != '\n') {
+                if (file.read(&c, 1) != 1) {
+                    return false;
+                }
+            }
+        }
+    } while (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+    int n = 0;
+    while (c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+        if (n + 1 == length) {
+            return false;
+        }
+        field[n++] = c;
+        // The single whitespace character after the last field ends the header
+        if (file.read(&c, 1) != 1) {
+            return false;
+        }
+    }
+    field[n] = 0;
+    return true;
+}
+
+static bool ReadPamHeader(QFile &file, int *width, int *height, int *depth)
+{
+    char line[IMAGE_HEADER_LENGTH];
+    int maxval = 0;
+    *width = *height = *depth = 0;
+    for (;;) {
+        if (file.readLine(line, sizeof(line)) <= 0) {
+            return false;
+        }
+        if (!strncmp(line, "ENDHDR", 6)) {
+            break;
+        }
+        sscanf(line, "WIDTH %d", width);
+        sscanf(line, "HEIGHT %d", height);
+        sscanf(line, "DEPTH %d", depth);
+        sscanf(line, "MAXVAL %d", &maxval);
+    }
+    return maxval == 255 && (*depth == 3 || *depth == 4);
+}
+
+bool ImageReadHeader(QFile &file, ImageFileFormat format, int *width, int *height, int *channels,
+                     bool *big_endian)
+{
+    char magic[3] = { 0, 0, 0 };
+    char field[3][32];
+    if (file.read(magic, 3) != 3) {
+        return false;
+    }
+    if (format == IMAGE_FORMAT_PAM && !strncmp(magic, "P7\n", 3)) {
+        return ReadPamHeader(file, width, height, channels) && *width > 0 && *height > 0;
+    }
+    // PPM and PFM headers are three fields; the whitespace after the magic number was
+    // read with it
+    for (int i = 0; i < 3; i++) {
+        if (!ReadHeaderField(file, field[i], sizeof(field[i]))) {
+            return false;
+        }
+    }
+    *width = atoi(field[0]);
+    *height = atoi(field[1]);
+    if (*width <= 0 || *height <= 0) {
+        return false;
+    }
+    if (format == IMAGE_FORMAT_PPM && !strncmp(magic, "P6", 2)) {
+        *channels = 3;
+        return atoi(field[2]) == 255;
+    }
+    if (format == IMAGE_FORMAT_PFM && (!strncmp(magic, "PF", 2) || !strncmp(magic, "Pf", 2))) {
+        // The sign of the scale gives the byte order
+        *channels = magic[1] == 'F' ? 3 : 1;
+        if (big_endian) {
+            *big_endian = atof(field[2]) > 0;
+        }
+        return true;
+    }
+    return false;
+}
+
+int ImageWriteHeader(char *header, ImageFileFormat format, int width, int height)
+{
+    switch (format) {
+    case IMAGE_FORMAT_PPM:
+        return sprintf(header, "P6\n%d %d\n255\n", width, height);
+    case IMAGE_FORMAT_PFM:
+        return sprintf(header, "PF\n%d %d\n-1.0\n", width, height);
+    case IMAGE_FORMAT_PAM: {
+        int length = sprintf(header, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\n",
+                             width, height);
+        // Pad with a comment line up to the next multiple of 64, leaving room for ENDHDR
+        int padded = (length + 2 + 7 + 63) / 64 * 64;
+        header[length++] = '#';
+        while (length < padded - 8) {
+            header[length++] = ' ';
+        }
+        header[length++] = '\n';
+        return length + sprintf(header + length, "ENDHDR\n");
+    }
+    default:
+        return 0;
+    }
+}
+
+bool ImageSameFile(const QString &a, const QString &b)
+{
+#ifdef Q_OS_UNIX
+    struct stat sa, sb;
+    QByteArray na = a.toLocal8Bit(), nb = b.toLocal8Bit();
+    return stat(na.constData(), &sa) == 0 && stat(nb.constData(), &sb) == 0 &&
+           sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+#else
+    QString ca = QFileInfo(a).canonicalFilePath(), cb = QFileInfo(b).canonicalFilePath();
+    return !ca.isEmpty() && ca == cb;
+#endif
+}
+
+
+ImageStripReader::ImageStripReader()
+    : width(0), height(0), channels(0), dataOffset(0)
+{
+}
+
+bool ImageStripReader::Open(const char *filename)
+{
+    this->filename = QString(filename);
+    file.setFileName(this->filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    // Try the raw formats the rows can be read from directly
+    const ImageFileFormat formats[2] = { IMAGE_FORMAT_PPM, IMAGE_FORMAT_PAM };
+    for (int i = 0; i < 2; i++) {
+        if (file.seek(0) && ImageReadHeader(file, formats[i], &width, &height, &channels)) {
+            dataOffset = file.pos();
+            return true;
+        }
+    }
+    file.close();
+
+    // Let Qt find out the format and size; the pixels are decoded strip by strip
+    QImageReader reader(this->filename);
+    QSize size = reader.size();
+    if (!size.isValid()) {
+        return false;
+    }
+    width = size.width();
+    height = size.height();
+    channels = 0;
+    return true;
+}
+
+bool ImageStripReader::ReadRows(int first, int count, Image *strip)
+{
+    if (strip->Width() != width || strip->Height() != count) {
+        *strip = Image(width, count);
+    }
+    strip->Detach();
+    if (channels) {
+        if (!file.seek(dataOffset + (qint64)first * width * channels)) {
+            return false;
+        }
+        uchar *line = (uchar *)malloc((size_t)width * channels);
+        for (int y = 0; y < count; y++) {
+            if (file.read((char *)line, (qint64)width * channels) != (qint64)width * channels) {
+                free(line);
+                return false;
+            }
+            ImagePixel *row = strip->Row(y);
+            for (int x = 0; x < width; x++) {
+                const uchar *p = line + x * channels;
+                row[x].r = p[0];
+                row[x].g = p[1];
+                row[x].b = p[2];
+                row[x].a = channels == 4 ? p[3] : 0xff;
+            }
+        }
+        free(line);
+        strip->PixelsChanged();
+        return true;
+    }
+
+    // A reader decodes once, so every strip needs its own
+    QImageReader reader(filename);
+    reader.setClipRect(QRect(0, first, width, count));
+    QImage image = reader.read();
+    if (image.isNull()) {
+        return false;
+    }
+    image = image.convertToFormat(QImage::Format_RGBA8888);
+    for (int y = 0; y < count; y++) {
+        memcpy(strip->Row(y), image.constScanLine(y), width * sizeof(ImagePixel));
+    }
+    strip->PixelsChanged();
+    return true;
+}
+
+
+ImageStripWriter::ImageStripWriter()
+    : width(0), height(0), written(0), channels(0)
+{
+}
+
+bool ImageStripWriter::Open(const char *filename, int width, int height)
+{
+    const char *extension = strrchr(filename, '.');
+    ImageFileFormat format;
+    if (extension && !strcmp(extension, ".ppm")) {
+        format = IMAGE_FORMAT_PPM;
+        channels = 3;
+    }
+    else if (extension && !strcmp(extension, ".pam")) {
+        format = IMAGE_FORMAT_PAM;
+        channels = 4;
+    }
+    else {
+        return false;
+    }
+    this->width = width;
+    this->height = height;
+    written = 0;
+    file.setFileName(QString(filename));
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        return false;
+    }
+    char header[IMAGE_HEADER_LENGTH];
+    int length = ImageWriteHeader(header, format, width, height);
+    return file.write(header, length) == length;
+}
+
+bool ImageStripWriter::WriteRows(const Image &strip, int first, int count)
+{
+    uchar *line = (uchar *)malloc((size_t)width * channels);
+    bool ok = true;
+    for (int y = first; ok && y < first + count; y++) {
+        const ImagePixel *row = strip.Row(y);
+        if (channels == 4) {
+            memcpy(line, row, width * sizeof(ImagePixel));
+        }
+        else {
+            for (int x = 0; x < width; x++) {
+                line[3 * x] = row[x].r;
+                line[3 * x + 1] = row[x].g;
+                line[3 * x + 2] = row[x].b;
+            }
+        }
+        ok = file.write((const char *)line, (qint64)width * channels) == (qint64)width * channels;
+    }
+    free(line);
+    written += count;
+    return ok;
+}
+
+bool ImageStripWriter::Close()
+{
+    bool ok = file.flush() && written == height;
+    file.close();
+    return ok;
+}
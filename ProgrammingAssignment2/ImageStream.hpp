@@ -0,0 +1,96 @@
+#ifndef IMAGESTREAM_HPP
+#define IMAGESTREAM_HPP
+
+#include "Image.hpp"
+
+// Room for any header ImageWriteHeader produces
+#define IMAGE_HEADER_LENGTH 256
+
+/*
+Reads the header of a binary PPM (P6), PAM (P7) or PFM (PF or Pf) file, leaving file at the
+first pixel. channels is set to 3 or 4 for PPM and PAM, and to 3 or 1 for PFM. PFM pixels are
+floats, little-endian unless big_endian is set, with the bottom row first
+*/
+bool ImageReadHeader(QFile &file, ImageFileFormat format, int *width, int *height, int *channels,
+                     bool *big_endian = NULL);
+
+/*
+Writes the header for a PPM (3 channels), PAM (4 channels) or little-endian PFM (3 channels)
+file into header and returns its length. PAM headers are padded to a multiple of 64 bytes
+so a mapping of the file has cache line aligned pixels
+*/
+int ImageWriteHeader(char *header, ImageFileFormat format, int width, int height);
+
+/*
+Whether the names a and b lead to the same file, however they are spelled: through links,
+relative paths or hard links. Compares device and inode on Unix and canonical paths
+elsewhere. False when either file does not exist
+*/
+bool ImageSameFile(const QString &a, const QString &b);
+
+/*
+Reads an image a horizontal strip at a time, so images larger than memory can be
+processed. Binary PPM (P6) and PAM (P7) files are read directly from disk at any row.
+Other formats are decoded by Qt with a clip rectangle, which bounds memory to the strip
+but decodes a JPEG from its first row for every strip
+*/
+class ImageStripReader {
+public:
+    ImageStripReader();
+
+    /*
+    Opens filename and reads its dimensions without decoding any pixels
+    */
+    bool Open(const char *filename);
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+
+    /*
+    Reads rows [first, first + count) into strip, which is resized to width x count
+    */
+    bool ReadRows(int first, int count, Image *strip);
+
+private:
+    QString filename;
+    QFile file;
+    int width;
+    int height;
+    // Bytes per pixel of a PPM or PAM file, 0 when Qt decodes it
+    int channels;
+    qint64 dataOffset;
+};
+
+
+/*
+Writes an image a strip at a time, top to bottom. Qt can only encode whole images, so
+the output is a binary PPM (.ppm, alpha dropped) or PAM (.pam, with alpha) file
+*/
+class ImageStripWriter {
+public:
+    ImageStripWriter();
+
+    /*
+    Creates filename for a width x height image. Fails if the extension is not .ppm or .pam
+    */
+    bool Open(const char *filename, int width, int height);
+
+    /*
+    Appends rows [first, first + count) of strip to the file
+    */
+    bool WriteRows(const Image &strip, int first, int count);
+
+    /*
+    Flushes the file, failing if fewer rows were written than the image has
+    */
+    bool Close();
+
+private:
+    QFile file;
+    int width;
+    int height;
+    int written;
+    int channels;
+};
+
+#endif
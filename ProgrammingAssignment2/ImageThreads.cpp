@@ -0,0 +1,161 @@
+#include "ImageThreads.hpp"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Bands per thread; more than one so uneven rows (e.g. rotated images) balance out
+#define BANDS_PER_THREAD 4
+
+// A fixed set of workers that run the bands of one ImageParallelRows call at a time
+class ImageThreadPool {
+public:
+    ImageThreadPool(int threads);
+    ~ImageThreadPool();
+
+    /*
+    Calls task(i) for every i in [0, count) and waits for all of them to finish.
+    The calling thread works on tasks too
+    */
+    void Run(int count, const std::function<void(int)> &task);
+
+private:
+    void Work(std::unique_lock<std::mutex> &locked);
+    void WorkerLoop();
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const std::function<void(int)> *task;
+    int count;
+    int next;
+    int remaining;
+    unsigned generation;
+    bool quit;
+};
+
+ImageThreadPool::ImageThreadPool(int threads)
+    : task(NULL), count(0), next(0), remaining(0), generation(0), quit(false)
+{
+    // The calling thread is the last worker
+    for (int i = 1; i < threads; i++) {
+        workers.push_back(std::thread(&ImageThreadPool::WorkerLoop, this));
+    }
+}
+
+ImageThreadPool::~ImageThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> locked(mutex);
+        quit = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+void ImageThreadPool::Run(int count, const std::function<void(int)> &task)
+{
+    std::unique_lock<std::mutex> locked(mutex);
+    this->task = &task;
+    this->count = count;
+    next = 0;
+    remaining = count;
+    generation++;
+    wake.notify_all();
+    Work(locked);
+    while (remaining > 0) {
+        finished.wait(locked);
+    }
+    this->task = NULL;
+}
+
+// Take tasks until there are none left. Called with the mutex held
+void ImageThreadPool::Work(std::unique_lock<std::mutex> &locked)
+{
+    while (next < count) {
+        int i = next++;
+        locked.unlock();
+        (*task)(i);
+        locked.lock();
+        if (--remaining == 0) {
+            finished.notify_all();
+        }
+    }
+}
+
+void ImageThreadPool::WorkerLoop()
+{
+    std::unique_lock<std::mutex> locked(mutex);
+    unsigned seen = generation;
+    while (true) {
+        while (!quit && seen == generation) {
+            wake.wait(locked);
+        }
+        if (quit) {
+            return;
+        }
+        seen = generation;
+        Work(locked);
+    }
+}
+
+
+static int requestedThreads = 0;
+static ImageThreadPool *pool = NULL;
+static std::mutex poolBusy;
+static thread_local int threadsUsed = 1;
+
+void ImageSetThreads(int threads)
+{
+    std::lock_guard<std::mutex> busy(poolBusy);
+    requestedThreads = threads < 0 ? 0 : threads;
+    delete pool;
+    pool = NULL;
+}
+
+int ImageThreads()
+{
+    if (requestedThreads > 0) {
+        return requestedThreads;
+    }
+    int cores = (int)std::thread::hardware_concurrency();
+    return cores > 0 ? cores : 1;
+}
+
+void ImageParallelRows(int rows, const std::function<void(int, int)> &band)
+{
+    int threads = ImageThreads();
+    if (threads <= 1 || rows <= 1) {
+        band(0, rows);
+        return;
+    }
+    std::unique_lock<std::mutex> busy(poolBusy, std::try_to_lock);
+    if (!busy.owns_lock()) {
+        band(0, rows);
+        return;
+    }
+    if (!pool) {
+        pool = new ImageThreadPool(threads);
+    }
+    int bands = threads * BANDS_PER_THREAD < rows ? threads * BANDS_PER_THREAD : rows;
+    int rowsPerBand = (rows + bands - 1) / bands;
+    bands = (rows + rowsPerBand - 1) / rowsPerBand;
+    if (threadsUsed < (bands < threads ? bands : threads)) {
+        threadsUsed = bands < threads ? bands : threads;
+    }
+    pool->Run(bands, [&](int i) {
+        int first = i * rowsPerBand;
+        band(first, first + rowsPerBand < rows ? first + rowsPerBand : rows);
+    });
+}
+
+int ImageTakeThreadsUsed()
+{
+    int used = threadsUsed;
+    threadsUsed = 1;
+    return used;
+}
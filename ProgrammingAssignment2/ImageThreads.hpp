@@ -0,0 +1,34 @@
+#ifndef IMAGETHREADS_HPP
+#define IMAGETHREADS_HPP
+
+#include <functional>
+
+/*
+Sets the number of threads used by Image operators. 0 (the default) uses one thread
+per core, 1 runs everything on the calling thread
+*/
+void ImageSetThreads(int threads);
+
+/*
+Returns the number of threads Image operators will use
+*/
+int ImageThreads();
+
+/*
+Splits rows [0, rows) into bands and calls band(first_row, end_row) for each of them
+on a shared pool of worker threads, returning once every band is done. Bands are
+disjoint, so each call may write its own rows of a destination buffer without locking.
+Neighborhood operators read their halo (the rows just outside a band) from a source
+buffer that is not written during the call, so bands never wait on each other.
+When the pool is already busy, e.g. when operators run on several images at once,
+the bands run on the calling thread instead
+*/
+void ImageParallelRows(int rows, const std::function<void(int, int)> &band);
+
+/*
+Returns the most threads any ImageParallelRows call made from the calling thread has
+used since the last call to this function (1 if it made none), and starts counting again
+*/
+int ImageTakeThreadsUsed();
+
+#endif
@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include "Image.hpp"
+#include "ImageSimd.hpp"
+#include "ImageThreads.hpp"
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// Program arguments
+static char options[] =
+"\n"
+"  -help\n"
+"  -images <file:image>[,<file:image> ...] (default Mountain_side.jpg,Checkerboard.jpg)\n"
+"  -megapixels <real:size>[,<real:size> ...] (default 1,12,48)\n"
+"  -operators <name>[,<name> ...] (default all)\n"
+"  -repetitions <int:count (default 3; the median is reported)>\n"
+"  -threads <int:count>[,<int:count> ...] (0=one per core [default])\n";
+
+
+// Print usage message and exit
+static void ShowUsage(void)
+{
+    fprintf(stderr, "Usage: bench_image [  -option [arg ...] ...] > results.json\n");
+    fprintf(stderr, "%s", options);
+    exit(EXIT_FAILURE);
+}
+
+
+// Check if there are enough remaining arguments for option
+static void CheckOption(char *option, int argc, int minargc)
+{
+    if (argc < minargc)  {
+        fprintf(stderr, "Too few arguments for %s\n", option);
+        ShowUsage();
+    }
+}
+
+
+// Keeps reads the compiler would otherwise drop
+static volatile quint32 sink;
+
+// One Image method, run on a fresh copy of the source image each repetition
+typedef struct {
+    const char *name;
+    std::function<void(Image &)> run;
+} Benchmark;
+
+static std::vector<Benchmark> Benchmarks()
+{
+    const ImagePointOp fused[3] = {
+        { IMAGE_OP_BRIGHTNESS, 1.2, 0 },
+        { IMAGE_OP_SATURATION, 1.5, 0 },
+        { IMAGE_OP_GAMMA, 0.8, 0 }
+    };
+    // A 9x9 and a 63x63 blur, one on each side of Convolve's switch to the FFT
+    std::vector<float> small(9 * 9, 1.0f / (9 * 9)), large(63 * 63, 1.0f / (63 * 63));
+    std::vector<Benchmark> benchmarks = {
+        { "BilateralFilter", [](Image &image) { image.BilateralFilter(30, 8); } },
+        { "BilateralFilterDirect", [](Image &image) { image.BilateralFilterDirect(30, 2); } },
+        { "BlackAndWhite", [](Image &image) { image.BlackAndWhite(); } },
+        { "BoxBlur", [](Image &image) { image.BoxBlur(8); } },
+        { "Brightness", [](Image &image) { image.Brightness(1.2); } },
+        { "ChannelExtract", [](Image &image) { image.ChannelExtract(IMAGE_GREEN_CHANNEL); } },
+        { "Composite", [](Image &image) {
+            // A two layer stack of a copy of the image, masked by its own luminance. The
+            // copy shares the image's pixels, so the time includes the image detaching
+            // from them before it writes (see Copy)
+            Image top(image);
+            ImageLayer layers[2] = {
+                { NULL, &top, &top, IMAGE_COMPOSITE_OVER },
+                { NULL, &top, NULL, IMAGE_COMPOSITE_ATOP }
+            };
+            image.Composite(layers, 2);
+        } },
+        { "Contrast", [](Image &image) { image.Contrast(0.5); } },
+        { "ConvolveFft", [large](Image &image) { image.Convolve(large.data(), 63, 63); } },
+        { "ConvolveSmall", [small](Image &image) { image.Convolve(small.data(), 9, 9); } },
+        { "Copy", [](Image &image) {
+            // Copies share pixels until one writes, so this is the cost of that write
+            Image copy(image);
+            copy.Detach();
+        } },
+        { "Crop", [](Image &image) { image.Crop(image.Width() / 4, image.Height() / 4, image.Width() / 2, image.Height() / 2); } },
+        { "Gamma", [](Image &image) { image.Gamma(0.8); } },
+        { "GaussianBlur", [](Image &image) { image.GaussianBlur(8); } },
+        { "GaussianBlurDirect", [](Image &image) { image.GaussianBlurDirect(2); } },
+        // Narrow and wide windows, which should take about the same time
+        { "MedianFilter", [](Image &image) { image.MedianFilter(7); } },
+        { "MedianFilterWide", [](Image &image) { image.MedianFilter(101); } },
+        { "MotionBlur", [](Image &image) { image.MotionBlur(20); } },
+        { "MotionBlurDiagonal", [](Image &image) { image.MotionBlur(20, 30); } },
+        { "Nonphotorealism", [](Image &image) { image.Nonphotorealism(); } },
+        { "PointOps", [fused](Image &image) { image.PointOps(fused, 3); } },
+        { "ReadWritePam", [](Image &image) {
+            image.Write("bench_image.pam", IMAGE_FORMAT_PAM);
+            Image read;
+            read.Read("bench_image.pam", IMAGE_FORMAT_PAM);
+            // Touch every page, otherwise the mapping is never read
+            for (int y = 0; y < read.Height(); y++) {
+                sink += read.Row(y)[read.Width() / 2].g;
+            }
+        } },
+        { "RotateBilinear", [](Image &image) { image.Rotate(30, IMAGE_BILINEAR_SAMPLING); } },
+        { "RotatePoint", [](Image &image) { image.Rotate(30, IMAGE_POINT_SAMPLING); } },
+        { "Saturation", [](Image &image) { image.Saturation(1.5); } },
+        { "ScaleDownArea", [](Image &image) { image.Scale(0.3, 0.3, IMAGE_AREA_SAMPLING); } },
+        { "ScaleDownLanczos", [](Image &image) { image.Scale(0.5, 0.5, IMAGE_LANCZOS_SAMPLING); } },
+        { "ScaleUpBilinear", [](Image &image) { image.Scale(1.5, 1.5, IMAGE_BILINEAR_SAMPLING); } },
+        { "ScaleUpGaussian", [](Image &image) { image.Scale(1.5, 1.5, IMAGE_GAUSSIAN_SAMPLING); } },
+        { "Sharpen", [](Image &image) { image.Sharpen(); } }
+    };
+    return benchmarks;
+}
+
+
+// Starts a new peak memory measurement, where the platform allows it
+static void ResetPeakMemory()
+{
+#ifdef __GLIBC__
+    // Hands back what earlier runs freed, most of all the arenas of a pool with more threads
+    malloc_trim(0);
+#endif
+#ifdef Q_OS_LINUX
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if (file) {
+        fputs("5", file);
+        fclose(file);
+    }
+#endif
+}
+
+// Peak resident set size in megabytes since ResetPeakMemory (Linux) or since the
+// process started (other Unix systems), 0 where it is unknown
+static double PeakMemory()
+{
+#if defined(Q_OS_LINUX)
+    FILE *file = fopen("/proc/self/status", "r");
+    char line[256];
+    long kilobytes = 0;
+    while (file && fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "VmHWM: %ld", &kilobytes) == 1) {
+            break;
+        }
+    }
+    if (file) {
+        fclose(file);
+    }
+    return kilobytes / 1024.0;
+#elif defined(Q_OS_MAC)
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#elif defined(Q_OS_UNIX)
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+#else
+    return 0;
+#endif
+}
+
+
+// Scales image up to about megapixels million pixels. Scale allows at most 20x, so
+// small sources are scaled in several steps
+static void ScaleTo(Image *image, double megapixels)
+{
+    double factor = qSqrt(megapixels * 1e6 / ((double)image->Width() * image->Height()));
+    while (factor > 1.0001 || factor < 0.9999) {
+        double step = qBound(0.05, factor, 16.0);
+        image->Scale(step, step, IMAGE_BILINEAR_SAMPLING);
+        factor /= step;
+    }
+}
+
+
+// Benchmark start point. Results go to stdout as JSON, progress to stderr
+int main(int argc, char *argv[])
+{
+    QStringList images = QString("Mountain_side.jpg,Checkerboard.jpg").split(',', QString::SkipEmptyParts);
+    QStringList sizes = QString("1,12,48").split(',', QString::SkipEmptyParts);
+    QStringList names;
+    QStringList thread_counts = QString("0").split(',', QString::SkipEmptyParts);
+    int repetitions = 3;
+
+    argv++, argc--; // First argument is program name
+    while (argc > 0) {
+        if (!strcmp(*argv, "-help")) {
+            ShowUsage();
+        }
+        else if (!strcmp(*argv, "-images")) {
+            CheckOption(*argv, argc, 2);
+            images = QString(argv[1]).split(',', QString::SkipEmptyParts);
+        }
+        else if (!strcmp(*argv, "-megapixels")) {
+            CheckOption(*argv, argc, 2);
+            sizes = QString(argv[1]).split(',', QString::SkipEmptyParts);
+        }
+        else if (!strcmp(*argv, "-operators")) {
+            CheckOption(*argv, argc, 2);
+            names = QString(argv[1]).split(',', QString::SkipEmptyParts);
+        }
+        else if (!strcmp(*argv, "-repetitions")) {
+            CheckOption(*argv, argc, 2);
+            repetitions = atoi(argv[1]);
+            if (repetitions <= 0) {
+                fprintf(stderr, "Number of repetitions must be positive.\n");
+                ShowUsage();
+            }
+        }
+        else if (!strcmp(*argv, "-threads")) {
+            CheckOption(*argv, argc, 2);
+            thread_counts = QString(argv[1]).split(',', QString::SkipEmptyParts);
+            if (thread_counts.isEmpty()) {
+                fprintf(stderr, "At least one thread count is required.\n");
+                ShowUsage();
+            }
+        }
+        else {
+            fprintf(stderr, "bench_image: invalid option: %s\n", *argv);
+            ShowUsage();
+        }
+        argv += 2; argc -= 2;
+    }
+
+    std::vector<Benchmark> benchmarks = Benchmarks();
+    // Read every image before printing anything, so a bad name leaves no partial output
+    std::vector<Image> originals(images.size());
+    for (int i = 0; i < images.size(); i++) {
+        QByteArray image_name = images.at(i).toLocal8Bit();
+        if (!originals[i].Read(image_name.constData())) {
+            fprintf(stderr, "Unable to read image from %s\n", image_name.constData());
+            exit(-1);
+        }
+    }
+
+    // Every thread count, as ImageThreads resolves it
+    std::vector<int> threads;
+    printf("{\n  \"threads\": [");
+    for (int t = 0; t < thread_counts.size(); t++) {
+        ImageSetThreads(thread_counts.at(t).toInt());
+        threads.push_back(ImageThreads());
+        printf("%s%d", t ? ", " : "", threads.back());
+    }
+    printf("],\n  \"simd\": \"%s\",\n  \"results\": [", ImageSimd()->name);
+    bool first = true;
+    for (int i = 0; i < images.size(); i++) {
+        QByteArray image_name = images.at(i).toLocal8Bit();
+        for (int j = 0; j < sizes.size(); j++) {
+            Image source(originals[i]);
+            ScaleTo(&source, sizes.at(j).toDouble());
+            double pixels = (double)source.Width() * source.Height();
+            for (size_t k = 0; k < benchmarks.size(); k++) {
+                const Benchmark &benchmark = benchmarks[k];
+                if (!names.isEmpty() && !names.contains(QString(benchmark.name))) {
+                    continue;
+                }
+                // The speedup of each thread count is against the first one
+                double first_median = 0;
+                for (size_t t = 0; t < threads.size(); t++) {
+                    fprintf(stderr, "%s %dx%d %s threads %d\n", image_name.constData(), source.Width(), source.Height(),
+                            benchmark.name, threads[t]);
+                    ImageSetThreads(threads[t]);
+                    // Starts the pool's workers, so their creation is not timed
+                    ImageParallelRows(threads[t], [](int, int) {});
+
+                    std::vector<double> seconds;
+                    double peak = 0;
+                    for (int r = 0; r < repetitions; r++) {
+                        // Its own pixels, so operators writing in place do not copy them
+                        Image image(source);
+                        image.Detach();
+                        ResetPeakMemory();
+                        QElapsedTimer timer;
+                        timer.start();
+                        benchmark.run(image);
+                        seconds.push_back(timer.nsecsElapsed() / 1e9);
+                        peak = qMax(peak, PeakMemory());
+                    }
+                    std::sort(seconds.begin(), seconds.end());
+                    double median = seconds[seconds.size() / 2];
+                    if (t == 0) {
+                        first_median = median;
+                    }
+
+                    printf("%s\n    { \"image\": \"%s\", \"operator\": \"%s\", \"threads\": %d, \"width\": %d, "
+                           "\"height\": %d, \"megapixels\": %.3f, \"seconds\": %.6f, \"mp_per_s\": %.2f, "
+                           "\"ns_per_pixel\": %.3f, \"speedup\": %.2f, \"peak_rss_mb\": %.1f }",
+                           first ? "" : ",", image_name.constData(), benchmark.name, threads[t], source.Width(),
+                           source.Height(), pixels / 1e6, median, pixels / 1e6 / median, median * 1e9 / pixels,
+                           first_median / median, peak);
+                    fflush(stdout);
+                    first = false;
+                }
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+    remove("bench_image.pam");
+    return EXIT_SUCCESS;
+}
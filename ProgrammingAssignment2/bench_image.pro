@@ -0,0 +1,12 @@
+TEMPLATE = app
+TARGET = bench_image
+CONFIG += console warn_off release embed_manifest_exe c++11
+CONFIG -= app_bundle
+QT += gui
+SOURCES += bench_image.cpp Image.cpp ImageConvolve.cpp ImageFft.cpp ImageIntegral.cpp ImageSimd.cpp ImageStream.cpp ImageThreads.cpp
+HEADERS += Image.hpp ImageConvolve.hpp ImageFft.hpp ImageIntegral.hpp ImageSimd.hpp ImageStream.hpp ImageThreads.hpp
+QMAKE_CXXFLAGS += -I/usr/local/include
+unix:macx {
+QMAKE_LFLAGS += -stdlib=libc++
+QMAKE_CXXFLAGS += -stdlib=libc++
+}
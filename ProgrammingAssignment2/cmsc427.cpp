@@ -1,36 +1,69 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <atomic>
+#include <time.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 #include "Image.hpp"
+#include "ImageStream.hpp"
+#include "ImageThreads.hpp"
+#ifdef Q_OS_UNIX
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Output rows per strip with -stream when no memory limit is given
+#define STREAM_STRIP_ROWS 256
 
 // Program arguments
 static char options[] =
 "\n"
 "  -help\n"
-"  -bilateral_filter <real:domain> <real:range>\n"
+"  -bilateral_filter <real:domain> <real:range (0-255)>\n"
+"  -bilateral_filter_direct <real:domain> <real:range (0-255)>\n"
 "  -blackandwhite \n"
+"  -border <clamp|mirror|zero> (pixels beyond the edges for the operations after it)\n"
+"  -box_blur <int:radius>\n"
 "  -brightness <real:factor>\n"
 "  -channel_extract <int:channel (0=red,1=green,2=blue,3=alpha)>\n"
-"  -composite <file:bottom_mask> <file:top_image> <file:top_mask> <int:operation(0=over)>\n"
+"  -composite <file:bottom_mask> <file:top_image> <file:top_mask> <int:operation (0=over,1=in,2=out,3=atop)>\n"
 "  -contrast <real:factor>\n"
+"  -convolve <file:kernel (text: width height, then the weights row by row)>\n"
 "  -crop <int:x> <int:y> <int:width> <int:height>\n"
 "  -fun\n"
 "  -gamma <real:exponent>\n"
 "  -gaussian_blur <real:sigma>\n"
+"  -gaussian_blur_direct <real:sigma>\n"
+"  -max_memory <int:megabytes (implies -stream)>\n"
 "  -median_filter <int:width>\n"
-"  -motion_blur <real:magnitude>\n"
+"  -motion_blur <real:length> [<real:angle (in degrees, default 0)>]\n"
 "  -nonphotorealism\n"
+"  -roi <int:x> <int:y> <int:width> <int:height> (the operations after it change only this region)\n"
 "  -rotate <real:angle (in degrees)> \n"
-"  -sampling <int:method (0=point [default],1=bilinear,2=gaussian)>\n"
+"  -sampling <int:method (0=point [default],1=bilinear,2=gaussian,3=lanczos,4=area (scale only))>\n"
 "  -saturation <real:factor>\n"
 "  -scale <real:sx> <real:sy>\n"
-"  -sharpen\n";
+"  -sharpen\n"
+"  -stream (process in strips; output must be .ppm or .pam)\n"
+"  -threads <int:count (0=one per core [default])>\n"
+"  -trace <file:trace.json (Chrome trace event format)>\n";
 
 
 // Print usage message and exit
 static void ShowUsage(void)
 {
-    fprintf(stderr, "Usage: cmsc427 <jpg:input_image> <jpg:output_image> [  -option [arg ...] ...]\n");
+    fprintf(stderr, "Usage: cmsc427 <jpg|ppm|pam|pfm:input_image> <jpg|ppm|pam|pfm:output_image> [  -option [arg ...] ...]\n");
+    fprintf(stderr, "       cmsc427 --batch <dir:input_dir> <dir:output_dir> [  -option [arg ...] ...]\n");
+    fprintf(stderr, "       cmsc427 --serve <file:socket> [-threads <int:count>]\n");
     fprintf(stderr, "%s", options);
     exit(EXIT_FAILURE);
 }
@@ -47,171 +80,1389 @@ static void CheckOption(char *option, int argc, int minargc)
 }
 
 
-// Application start point
-int main(int argc, char *argv[])
+// Picks a file format from filename's extension, defaulting to JPG
+static ImageFileFormat FormatFromExtension(const char *filename)
 {
-    // Look for help
-    for (int i = 0; i < argc; i++) {
-        if (!strcmp(argv[i], "-help")) {
-            ShowUsage();
-        }
+    QString name(filename);
+    if (name.endsWith(".ppm", Qt::CaseInsensitive)) {
+        return IMAGE_FORMAT_PPM;
+    }
+    if (name.endsWith(".pam", Qt::CaseInsensitive)) {
+        return IMAGE_FORMAT_PAM;
+    }
+    if (name.endsWith(".pfm", Qt::CaseInsensitive)) {
+        return IMAGE_FORMAT_PFM;
     }
+    return IMAGE_FORMAT_JPG;
+}
 
-    // Set the default sampling method to use
-    int sampling_method = IMAGE_POINT_SAMPLING;
-    // See if a different sampling method was specified
-    for (int i = 0; i < argc; i++) {
-        if (!strcmp(argv[i], "-sampling")) {
-            int method = atoi(argv[i+1]);
-            if (method == 0) {
-                sampling_method = IMAGE_POINT_SAMPLING;
-            }
-            else if (method == 1) {
-                sampling_method = IMAGE_BILINEAR_SAMPLING;
-            }
-            else if (method == 2) {
-                sampling_method = IMAGE_GAUSSIAN_SAMPLING;
-            }
-            else {
-                fprintf(stderr, "Sampling method specified incorrectly.\n");
-                ShowUsage();
-                exit(-1);
-            }
+
+
+// Operations that can be requested on the command line
+typedef enum {
+    OP_BILATERAL_FILTER,
+    OP_BILATERAL_FILTER_DIRECT,
+    OP_BLACKANDWHITE,
+    OP_BOX_BLUR,
+    OP_BRIGHTNESS,
+    OP_CHANNEL_EXTRACT,
+    OP_COMPOSITE,
+    OP_CONTRAST,
+    OP_CONVOLVE,
+    OP_CROP,
+    OP_FUN,
+    OP_GAMMA,
+    OP_GAUSSIAN_BLUR,
+    OP_GAUSSIAN_BLUR_DIRECT,
+    OP_MEDIAN_FILTER,
+    OP_MOTION_BLUR,
+    OP_NONPHOTOREALISM,
+    OP_ROI,
+    OP_ROTATE,
+    OP_SATURATION,
+    OP_SCALE,
+    OP_SHARPEN
+} OperationType;
+
+
+// One node of the operation graph built from the command line
+typedef struct {
+    OperationType type;
+    double args[4];
+    const char *name; // the option itself, for error messages
+    bool has_average; // set when a streamed Contrast already knows the average luminance
+    double average;
+    Image *layers[3]; // -composite's bottom mask, top image and top mask, read when parsed
+    std::vector<float> *kernel; // -convolve's weights, args[0] wide and args[1] high, read when parsed
+    int border; // the ImageBorder of the last -border before it, or -1 for the operator's own
+} Operation;
+
+
+// Reads a -composite layer or mask the same way as the input image. Returns NULL, with
+// the reason in error, if it cannot
+static Image *ReadLayer(const char *filename, std::string *error)
+{
+    Image *layer = new Image();
+    if (!layer->Read(filename, FormatFromExtension(filename))) {
+        *error = std::string("Unable to read image from ") + filename;
+        delete layer;
+        return NULL;
+    }
+    return layer;
+}
+
+
+// Reads a -convolve kernel file: the width and height, then width * height weights row
+// by row, separated by whitespace. Returns false, with the reason in error, if the file
+// is not one
+static bool ReadKernel(const char *filename, std::vector<float> *kernel, int *width, int *height,
+                       std::string *error)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        *error = std::string("Unable to read kernel from ") + filename;
+        return false;
+    }
+    bool ok = fscanf(file, "%d %d", width, height) == 2 && *width > 0 && *height > 0 &&
+              (qint64)*width * *height <= 1 << 24;
+    if (ok) {
+        kernel->resize((size_t)*width * *height);
+        for (size_t i = 0; ok && i < kernel->size(); i++) {
+            ok = fscanf(file, "%f", &(*kernel)[i]) == 1;
         }
     }
+    // Nothing but whitespace may follow, so a grid without its size line is not taken
+    // for a smaller kernel
+    char extra;
+    ok = ok && fscanf(file, " %c", &extra) == EOF;
+    fclose(file);
+    if (!ok) {
+        *error = std::string(filename) +
+                 " is not a kernel: expected a width, a height and exactly width * height weights";
+        return false;
+    }
+    // The direct convolution's 32-bit fixed-point sums must hold 255 times the weights
+    double magnitude = 0;
+    for (size_t i = 0; i < kernel->size(); i++) {
+        magnitude += qAbs((*kernel)[i]);
+    }
+    if (magnitude > INT_MAX / 255 / 2) {
+        *error = "Convolution kernel weights are too large";
+        return false;
+    }
+    return true;
+}
 
-    // Read input and output image filenames
-    if (argc < 3) ShowUsage();
-    argv++, argc--; // First argument is program name
-    char *input_image_name = *argv; argv++, argc--;
-    char *output_image_name = *argv; argv++, argc--;
 
-    // Allocate memory for image
-    Image *image = new Image();
-    if (!image) {
-        fprintf(stderr, "Unable to allocate image\n");
-        exit(-1);
+// Frees the layers and kernels read for ops
+static void ReleaseOperations(Operation *ops, int count)
+{
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < 3; j++) {
+            delete ops[i].layers[j];
+        }
+        delete ops[i].kernel;
     }
+}
 
-    // Read input image
-    if (!image->Read(input_image_name)) {
-        fprintf(stderr, "Unable to read image from %s\n", input_image_name);
-        exit(-1);
+// ParseOperations' results when the options are not a list of operations
+#define PARSE_BAD_ARGUMENT -1 // an option's argument is out of range or unreadable
+#define PARSE_BAD_OPTION -2 // an option is unknown or short of arguments
+
+// Sets error if option, with the argc - 1 arguments after it, has fewer than minargc - 1
+static bool HasArguments(const char *option, int argc, int minargc, std::string *error)
+{
+    if (argc < minargc) {
+        *error = std::string("Too few arguments for ") + option;
+        return false;
     }
+    return true;
+}
 
-    // Parse arguments in order (left to right) and perform operations
+// Parse the options into ops (which must have room for argc entries) without
+// running anything. Returns the number of operations, or PARSE_BAD_ARGUMENT or
+// PARSE_BAD_OPTION with the reason in error, and then ops holds nothing to free
+static int ParseOperations(int argc, char **argv, Operation *ops, std::string *error)
+{
+    int count = 0;
+    int border = -1;
+    int result = 0;
     while (argc > 0) {
+        Operation *op = &ops[count++];
+        memset(op, 0, sizeof(Operation));
+        op->name = *argv;
+        op->border = border;
         if (!strcmp(*argv, "-bilateral_filter")) {
-            CheckOption(*argv, argc, 3);
-            double sx = atof(argv[1]);
-            double sy = atof(argv[2]);
+            if (!HasArguments(*argv, argc, 3, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_BILATERAL_FILTER;
+            op->args[0] = atof(argv[1]); // domain
+            op->args[1] = atof(argv[2]); // range
+            argv += 3; argc -= 3;
+        }
+        else if (!strcmp(*argv, "-bilateral_filter_direct")) {
+            if (!HasArguments(*argv, argc, 3, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_BILATERAL_FILTER_DIRECT;
+            op->args[0] = atof(argv[1]); // domain
+            op->args[1] = atof(argv[2]); // range
             argv += 3; argc -= 3;
-            image->BilateralFilter(sy, sx);
         }
         else if (!strcmp(*argv, "-blackandwhite")) {
+            op->type = OP_BLACKANDWHITE;
             argv++, argc--;
-            image->BlackAndWhite();
+        }
+        else if (!strcmp(*argv, "-border")) {
+            if (!HasArguments(*argv, argc, 2, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            if (!strcmp(argv[1], "clamp")) {
+                border = IMAGE_BORDER_CLAMP;
+            }
+            else if (!strcmp(argv[1], "mirror")) {
+                border = IMAGE_BORDER_MIRROR;
+            }
+            else if (!strcmp(argv[1], "zero")) {
+                border = IMAGE_BORDER_ZERO;
+            }
+            else {
+                *error = std::string("-border must be clamp, mirror or zero, not ") + argv[1];
+                result = PARSE_BAD_ARGUMENT;
+                break;
+            }
+            // Not an operation itself
+            count--;
+            argv += 2; argc -= 2;
+        }
+        else if (!strcmp(*argv, "-box_blur")) {
+            if (!HasArguments(*argv, argc, 2, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_BOX_BLUR;
+            op->args[0] = atoi(argv[1]);
+            argv += 2; argc -= 2;
         }
         else if (!strcmp(*argv, "-brightness")) {
-            CheckOption(*argv, argc, 2);
-            double factor = atof(argv[1]);
+            if (!HasArguments(*argv, argc, 2, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_BRIGHTNESS;
+            op->args[0] = atof(argv[1]);
             argv += 2; argc -=2;
-            image->Brightness(factor);
         }
         else if (!strcmp(*argv, "-channel_extract")) {
-            CheckOption(*argv, argc, 2);
-            int channel = atoi(argv[1]);
+            if (!HasArguments(*argv, argc, 2, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_CHANNEL_EXTRACT;
+            op->args[0] = atoi(argv[1]);
             argv += 2; argc -= 2;
-            image->ChannelExtract(channel);
         }
         else if (!strcmp(*argv, "-composite")) {
-            CheckOption(*argv, argc, 5);
+            if (!HasArguments(*argv, argc, 5, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_COMPOSITE;
+            op->args[0] = atoi(argv[4]);
+            if (op->args[0] < 0 || op->args[0] >= IMAGE_COMPOSITE_OPERATIONS) {
+                *error = "Composite operation must be 0 (over), 1 (in), 2 (out) or 3 (atop)";
+                result = PARSE_BAD_ARGUMENT;
+                break;
+            }
+            // Read once here, so --batch shares them between every file
+            for (int i = 0; i < 3 && result == 0; i++) {
+                op->layers[i] = ReadLayer(argv[1 + i], error);
+                result = op->layers[i] ? 0 : PARSE_BAD_ARGUMENT;
+            }
+            if (result) {
+                break;
+            }
             argv += 5; argc -= 5;
-            image->Composite();
         }
         else if (!strcmp(*argv, "-contrast")) {
-            CheckOption(*argv, argc, 2);
-            double factor = atof(argv[1]);
+            if (!HasArguments(*argv, argc, 2, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_CONTRAST;
+            op->args[0] = atof(argv[1]);
+            argv += 2; argc -= 2;
+        }
+        else if (!strcmp(*argv, "-convolve")) {
+            if (!HasArguments(*argv, argc, 2, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_CONVOLVE;
+            // Read once here, so a bad kernel is reported before any work and --batch,
+            // streamed strips and server requests all share it
+            op->kernel = new std::vector<float>();
+            int width, height;
+            if (!ReadKernel(argv[1], op->kernel, &width, &height, error)) {
+                result = PARSE_BAD_ARGUMENT;
+                break;
+            }
+            op->args[0] = width;
+            op->args[1] = height;
             argv += 2; argc -= 2;
-            image->Contrast(factor);
         }
         else if (!strcmp(*argv, "-crop")) {
-            CheckOption(*argv, argc, 5);
-            int x = atoi(argv[1]);
-            int y = atoi(argv[2]);
-            int w = atoi(argv[3]);
-            int h = atoi(argv[4]);
+            if (!HasArguments(*argv, argc, 5, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_CROP;
+            op->args[0] = atoi(argv[1]); // x
+            op->args[1] = atoi(argv[2]); // y
+            op->args[2] = atoi(argv[3]); // width
+            op->args[3] = atoi(argv[4]); // height
             argv += 5; argc -= 5; // remove the arguments from the list
-            image->Crop(x, y, w, h);
         }
         else if (!strcmp(*argv, "-fun")) {
+            op->type = OP_FUN;
             argv++, argc--;
-            image->Fun(sampling_method);
         }
         else if (!strcmp(*argv, "-gamma")) {
-            CheckOption(*argv, argc, 2);
-            double factor = atof(argv[1]);
+            if (!HasArguments(*argv, argc, 2, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_GAMMA;
+            op->args[0] = atof(argv[1]);
             argv += 2; argc -= 2;
-            image->Gamma(factor);
         }
         else if (!strcmp(*argv, "-gaussian_blur")) {
-            CheckOption(*argv, argc, 2);
-            double sigma = atof(argv[1]);
+            if (!HasArguments(*argv, argc, 2, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_GAUSSIAN_BLUR;
+            op->args[0] = atof(argv[1]);
+            argv += 2; argc -= 2;
+        }
+        else if (!strcmp(*argv, "-gaussian_blur_direct")) {
+            if (!HasArguments(*argv, argc, 2, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_GAUSSIAN_BLUR_DIRECT;
+            op->args[0] = atof(argv[1]);
             argv += 2; argc -= 2;
-            image->GaussianBlur(sigma);
         }
         else if (!strcmp(*argv, "-median_filter")) {
-            CheckOption(*argv, argc, 2);
-            int width = atoi(argv[1]);
+            if (!HasArguments(*argv, argc, 2, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_MEDIAN_FILTER;
+            op->args[0] = atoi(argv[1]);
             argv += 2; argc -= 2;
-            image->MedianFilter(width);
         }
         else if (!strcmp(*argv, "-motion_blur")) {
-            CheckOption(*argv, argc, 2);
-            double sigma = atof(argv[1]);
+            if (!HasArguments(*argv, argc, 2, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_MOTION_BLUR;
+            op->args[0] = atof(argv[1]);
+            // The angle is optional; it is the next argument if that is a number
+            char *end = NULL;
+            op->args[1] = argc > 2 ? strtod(argv[2], &end) : 0;
+            if (end && end != argv[2] && *end == 0) {
+                argv++, argc--;
+            }
+            else {
+                op->args[1] = 0;
+            }
             argv += 2; argc -= 2;
-            image->MotionBlur(sigma);
         }
         else if (!strcmp(*argv, "-nonphotorealism")) {
+            op->type = OP_NONPHOTOREALISM;
             argv++, argc--;
-            image->Nonphotorealism();
+        }
+        else if (!strcmp(*argv, "-roi")) {
+            if (!HasArguments(*argv, argc, 5, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_ROI;
+            op->args[0] = atoi(argv[1]); // x
+            op->args[1] = atoi(argv[2]); // y
+            op->args[2] = atoi(argv[3]); // width
+            op->args[3] = atoi(argv[4]); // height
+            if (op->args[2] < 0 || op->args[3] < 0) {
+                *error = "Region width and height must be nonnegative";
+                result = PARSE_BAD_ARGUMENT;
+                break;
+            }
+            argv += 5; argc -= 5;
         }
         else if (!strcmp(*argv, "-rotate")) {
-            CheckOption(*argv, argc, 2);
-            double angle = atof(argv[1]);
+            if (!HasArguments(*argv, argc, 2, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_ROTATE;
+            op->args[0] = atof(argv[1]);
             argv += 2; argc -= 2;
-            image->Rotate(angle, sampling_method);
         }
-        else if (!strcmp(*argv, "-sampling")) {
+        else if (!strcmp(*argv, "-sampling") || !strcmp(*argv, "-threads") ||
+                 !strcmp(*argv, "-max_memory") || !strcmp(*argv, "-trace")) {
             // skip this flag. it has already been set above.
+            count--;
             argv += 2; argc -= 2;
         }
         else if (!strcmp(*argv, "-saturation")) {
-            CheckOption(*argv, argc, 2);
-            double factor = atof(argv[1]);
+            if (!HasArguments(*argv, argc, 2, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_SATURATION;
+            op->args[0] = atof(argv[1]);
             argv += 2; argc -= 2;
-            image->Saturation(factor);
         }
         else if (!strcmp(*argv, "-scale")) {
-            CheckOption(*argv, argc, 3);
-            double sx = atof(argv[1]);
-            double sy = atof(argv[2]);
+            if (!HasArguments(*argv, argc, 3, error)) {
+                result = PARSE_BAD_OPTION;
+                break;
+            }
+            op->type = OP_SCALE;
+            op->args[0] = atof(argv[1]);
+            op->args[1] = atof(argv[2]);
             argv += 3; argc -= 3;
-            image->Scale(sx, sy, sampling_method);
         }
         else if (!strcmp(*argv, "-sharpen")) {
+            op->type = OP_SHARPEN;
+            argv++, argc--;
+        }
+        else if (!strcmp(*argv, "-stream")) {
+            // skip this flag. it has already been set above.
+            count--;
             argv++, argc--;
-            image->Sharpen();
         }
         else {
             // Unrecognized program argument
-            fprintf(stderr, "image: invalid option: %s\n", *argv);
+            *error = std::string("image: invalid option: ") + *argv;
+            result = PARSE_BAD_OPTION;
+            break;
+        }
+    }
+    // These filters keep their own edges, so a -border before them that asks for other
+    // edges is refused rather than ignored
+    for (int i = 0; i < count && !result; i++) {
+        switch (ops[i].type) {
+        case OP_BILATERAL_FILTER:
+        case OP_BILATERAL_FILTER_DIRECT:
+            if (ops[i].border >= 0) {
+                *error = std::string(ops[i].name) +
+                         " leaves out the pixels beyond the edges, so it cannot follow -border";
+                result = PARSE_BAD_ARGUMENT;
+            }
+            break;
+        case OP_GAUSSIAN_BLUR:
+        case OP_GAUSSIAN_BLUR_DIRECT:
+        case OP_MEDIAN_FILTER:
+        case OP_NONPHOTOREALISM:
+            if (ops[i].border >= 0 && ops[i].border != IMAGE_BORDER_CLAMP) {
+                *error = std::string(ops[i].name) +
+                         " always repeats the edge pixels, so it can only follow -border clamp";
+                result = PARSE_BAD_ARGUMENT;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    if (result) {
+        ReleaseOperations(ops, count);
+        return result;
+    }
+    return count;
+}
+
+
+// Frees what ParseOperations read for ops, and ops itself
+static void FreeOperations(Operation *ops, int count)
+{
+    ReleaseOperations(ops, count);
+    delete[] ops;
+}
+
+
+// Fill in point if op only looks at one pixel at a time, so it can be fused with its neighbours
+static bool ToPointOp(const Operation &op, ImagePointOp *point)
+{
+    memset(point, 0, sizeof(ImagePointOp));
+    switch (op.type) {
+    case OP_BLACKANDWHITE:
+        point->type = IMAGE_OP_SATURATION; // Black & White is just Saturation 0
+        point->factor = 0;
+        return true;
+    case OP_BRIGHTNESS:
+        point->type = IMAGE_OP_BRIGHTNESS;
+        point->factor = op.args[0];
+        return true;
+    case OP_CHANNEL_EXTRACT:
+        point->type = IMAGE_OP_CHANNEL_EXTRACT;
+        point->channel = (int)op.args[0];
+        return true;
+    case OP_CONTRAST:
+        point->type = IMAGE_OP_CONTRAST;
+        point->factor = op.args[0];
+        point->average = op.has_average ? op.average : -1;
+        return true;
+    case OP_GAMMA:
+        point->type = IMAGE_OP_GAMMA;
+        point->factor = op.args[0];
+        return true;
+    case OP_SATURATION:
+        point->type = IMAGE_OP_SATURATION;
+        point->factor = op.args[0];
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+// The -trace file, NULL when tracing is off
+static FILE *trace_file = NULL;
+static std::mutex trace_lock;
+static QElapsedTimer trace_clock;
+static int trace_events = 0;
+static std::atomic<int> trace_threads(0);
+static thread_local int trace_thread = 0;
+
+// Runs work, recording it as a complete event called name when tracing is on. CPU time
+// is the whole process's, so with --batch it includes the other files' work too
+static void Traced(const char *name, const std::function<void()> &work)
+{
+    if (!trace_file) {
+        work();
+        return;
+    }
+    if (!trace_thread) {
+        trace_thread = ++trace_threads;
+    }
+    ImageTakeThreadsUsed();
+    quint64 bytes = Image::AllocatedBytes();
+    clock_t cpu = clock();
+    qint64 start = trace_clock.nsecsElapsed();
+    work();
+    qint64 end = trace_clock.nsecsElapsed();
+    double cpu_ms = (clock() - cpu) * 1000.0 / CLOCKS_PER_SEC;
+    int threads = ImageTakeThreadsUsed();
+    bytes = Image::AllocatedBytes() - bytes;
+
+    std::lock_guard<std::mutex> lock(trace_lock);
+    fprintf(trace_file, "%s\n{\"name\": \"%s\", \"cat\": \"image\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+            "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"cpu_ms\": %.3f, \"bytes_allocated\": %llu, \"threads\": %d}}",
+            trace_events++ ? "," : "", name, trace_thread, start / 1e3, (end - start) / 1e3, cpu_ms,
+            (unsigned long long)bytes, threads);
+}
+
+// Ends the -trace file's event array, whichever way the program exits
+static void CloseTrace(void)
+{
+    std::lock_guard<std::mutex> lock(trace_lock);
+    if (trace_file) {
+        fprintf(trace_file, "\n]}\n");
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+}
+
+
+// The border op was given with -border, or fallback
+static ImageBorder OperationBorder(const Operation &op, ImageBorder fallback)
+{
+    return op.border < 0 ? fallback : (ImageBorder)op.border;
+}
+
+
+// Sets error if an operator would reject op's arguments on image, whose first row is row
+// first_row of the whole image, so the request is refused rather than ended by the
+// operator's exit()
+static bool CheckOperation(const Operation &op, const Image &image, int sampling_method, int first_row,
+                           std::string *error)
+{
+    const char *message = NULL;
+    switch (op.type) {
+    case OP_BILATERAL_FILTER:
+    case OP_BILATERAL_FILTER_DIRECT:
+        if (op.args[0] <= 0 || op.args[1] <= 0) {
+            message = "Bilateral sigmas must be positive real values";
+        }
+        break;
+    case OP_BOX_BLUR:
+        if (op.args[0] < 0 || op.args[0] > IMAGE_BOX_BLUR_MAX_RADIUS) {
+            message = "Box blur radius must be a non-negative integer no greater than 16777216";
+        }
+        break;
+    case OP_BRIGHTNESS:
+        if (op.args[0] < 0 || 2 < op.args[0]) {
+            message = "Brightness alpha factor must be in the range [0.0, 2.0]";
+        }
+        break;
+    case OP_CHANNEL_EXTRACT:
+        if (op.args[0] < 0 || op.args[0] >= IMAGE_NUM_CHANNELS) {
+            message = "Channel must be one of 0=red, 1=green, 2=blue, 3=alpha";
+        }
+        break;
+    case OP_COMPOSITE:
+        for (int i = 0; i < 3; i++) {
+            if (op.layers[i]->Width() != image.Width() || op.layers[i]->Height() < first_row + image.Height()) {
+                message = "Composite layers and masks must be the same size as the image";
+            }
+        }
+        break;
+    case OP_CONTRAST:
+        if (op.args[0] < -1 || 2 < op.args[0]) {
+            message = "Contrast alpha factor must be in the range [-1.0, 2.0]";
+        }
+        break;
+    case OP_CROP:
+        if (op.args[2] < 0 || op.args[3] < 0) {
+            message = "Width and height must be nonnegative";
+        }
+        break;
+    case OP_GAMMA:
+        if (op.args[0] <= 0) {
+            message = "Gamma exponent must be a positive real value";
+        }
+        break;
+    case OP_GAUSSIAN_BLUR:
+    case OP_GAUSSIAN_BLUR_DIRECT:
+        if (op.args[0] <= 0) {
+            message = "Blur sigma must be a positive real value";
+        }
+        break;
+    case OP_MEDIAN_FILTER:
+        if (op.args[0] <= 0 || (int)op.args[0] % 2 == 0 || op.args[0] > 255) {
+            message = "Median filter width must be a positive odd integer no greater than 255";
+        }
+        break;
+    case OP_MOTION_BLUR:
+        if (op.args[0] <= 0) {
+            message = "Motion blur length must be a positive real value";
+        }
+        break;
+    case OP_ROTATE:
+    case OP_SCALE:
+        if (op.type == OP_ROTATE && (op.args[0] < 0 || 360 < op.args[0])) {
+            message = "Rotation angle must be in the range [0, 360]";
+        }
+        else if (op.type == OP_SCALE && (op.args[0] < 0.05 || 20 < op.args[0] || op.args[1] < 0.05 || 20 < op.args[1])) {
+            message = "Scaling factors must be in the range [0.05, 20]";
+        }
+        else if (sampling_method < IMAGE_POINT_SAMPLING || sampling_method > IMAGE_AREA_SAMPLING ||
+                 (op.type == OP_ROTATE && sampling_method == IMAGE_AREA_SAMPLING)) {
+            message = "Sampling method must be one of 0=point [default], 1=bilinear, 2=gaussian, 3=lanczos "
+                      "(4=area only scales)";
+        }
+        break;
+    default:
+        break;
+    }
+    if (message) {
+        *error = message;
+        return false;
+    }
+    return true;
+}
+
+
+// Perform a single operation that cannot be fused. first_row is the row of the whole image
+// the image's first row is, when it is a strip
+static void RunOperation(Image *image, const Operation &op, int sampling_method, int first_row)
+{
+    switch (op.type) {
+    case OP_BILATERAL_FILTER:
+        image->BilateralFilter(op.args[1], op.args[0], first_row);
+        break;
+    case OP_BILATERAL_FILTER_DIRECT:
+        image->BilateralFilterDirect(op.args[1], op.args[0]);
+        break;
+    case OP_BOX_BLUR:
+        image->BoxBlur((int)op.args[0], OperationBorder(op, IMAGE_BORDER_CLAMP));
+        break;
+    case OP_CONVOLVE:
+        image->Convolve(op.kernel->data(), (int)op.args[0], (int)op.args[1],
+                        OperationBorder(op, IMAGE_BORDER_CLAMP));
+        break;
+    case OP_CROP:
+        image->Crop((int)op.args[0], (int)op.args[1], (int)op.args[2], (int)op.args[3]);
+        break;
+    case OP_FUN:
+        image->Fun(sampling_method);
+        break;
+    case OP_GAUSSIAN_BLUR:
+        image->GaussianBlur(op.args[0]);
+        break;
+    case OP_GAUSSIAN_BLUR_DIRECT:
+        image->GaussianBlurDirect(op.args[0]);
+        break;
+    case OP_MEDIAN_FILTER:
+        image->MedianFilter((int)op.args[0]);
+        break;
+    case OP_MOTION_BLUR:
+        image->MotionBlur(op.args[0], op.args[1], OperationBorder(op, IMAGE_BORDER_CLAMP), first_row);
+        break;
+    case OP_NONPHOTOREALISM:
+        image->Nonphotorealism();
+        break;
+    case OP_ROTATE:
+        image->Rotate(op.args[0], sampling_method, OperationBorder(op, IMAGE_BORDER_ZERO));
+        break;
+    case OP_SCALE:
+        image->Scale(op.args[0], op.args[1], sampling_method, OperationBorder(op, IMAGE_BORDER_CLAMP));
+        break;
+    case OP_SHARPEN:
+        image->Sharpen(OperationBorder(op, IMAGE_BORDER_CLAMP));
+        break;
+    default:
+        break;
+    }
+}
+
+
+// Perform the operations in order. Runs of consecutive per-pixel operations are
+// fused into a single pass over the image; any other operation ends the run. Returns
+// false, with the reason in error, if an operation's arguments do not fit the image; the
+// operations before it have run by then
+static bool RunOperations(Image *image, const Operation *ops, int count, int sampling_method, std::string *error,
+                          int first_row = 0)
+{
+    ImagePointOp *fused = new ImagePointOp[count];
+    ImageLayer *layers = new ImageLayer[count];
+    bool ok = true;
+    int i = 0;
+    while (ok && i < count) {
+        if (ops[i].type == OP_ROI) {
+            // The rest run on a view of the region, which shares the image's pixels until
+            // an operation writes, and the result is pasted back
+            int x = (int)ops[i].args[0], y = (int)ops[i].args[1], w = (int)ops[i].args[2], h = (int)ops[i].args[3];
+            if (x < 0 || y < 0 || x + w > image->Width() || y + h > image->Height()) {
+                char message[128];
+                snprintf(message, sizeof(message), "-roi %d %d %d %d does not lie inside the %dx%d image",
+                         x, y, w, h, image->Width(), image->Height());
+                *error = message;
+                ok = false;
+                break;
+            }
+            Image region(*image);
+            region.Crop(x, y, w, h);
+            ok = RunOperations(&region, ops + i + 1, count - i - 1, sampling_method, error);
+            if (ok && (region.Width() != w || region.Height() != h)) {
+                *error = "Operations after -roi must keep the region's size";
+                ok = false;
+            }
+            if (ok) {
+                Traced("roi", [&]() { image->Paste(region, x, y); });
+            }
+            break;
+        }
+        // Consecutive composites are one stack, composited in one pass
+        int nlayers = 0;
+        while (i < count && ops[i].type == OP_COMPOSITE &&
+               (ok = CheckOperation(ops[i], *image, sampling_method, first_row, error))) {
+            ImageLayer layer = { ops[i].layers[0], ops[i].layers[1], ops[i].layers[2],
+                                 (ImageCompositeOperation)(int)ops[i].args[0] };
+            layers[nlayers++] = layer;
+            i++;
+        }
+        if (!ok) {
+            break;
+        }
+        if (nlayers > 0) {
+            std::string name;
+            for (int j = 0; trace_file && j < nlayers; j++) {
+                name += j > 0 ? "+composite" : "composite";
+            }
+            Traced(name.c_str(), [&]() { image->Composite(layers, nlayers, first_row); });
+            continue;
+        }
+        int nfused = 0;
+        while (i < count && ToPointOp(ops[i], &fused[nfused]) &&
+               (ok = CheckOperation(ops[i], *image, sampling_method, first_row, error))) {
+            nfused++, i++;
+        }
+        if (!ok) {
+            break;
+        }
+        if (nfused > 0) {
+            // Traced as one event named after the fused options, e.g. brightness+gamma
+            std::string name;
+            for (int j = i - nfused; trace_file && j < i; j++) {
+                name += std::string(j > i - nfused ? "+" : "") + (ops[j].name + 1);
+            }
+            Traced(name.c_str(), [&]() { image->PointOps(fused, nfused); });
+        }
+        else if ((ok = CheckOperation(ops[i], *image, sampling_method, first_row, error))) {
+            Traced(ops[i].name + 1, [&]() { RunOperation(image, ops[i], sampling_method, first_row); });
+            i++;
+        }
+    }
+    delete[] layers;
+    delete[] fused;
+    return ok;
+}
+
+
+// Rows above and below a strip that op reads to produce the strip's rows, or -1 if op
+// changes the image's size or needs all of it at once
+static int OperationHalo(const Operation &op)
+{
+    switch (op.type) {
+    case OP_BLACKANDWHITE:
+    case OP_BRIGHTNESS:
+    case OP_CHANNEL_EXTRACT:
+    case OP_COMPOSITE: // reads the layers' rows of the strip
+    case OP_CONTRAST: // the average luminance comes from an earlier pass
+    case OP_GAMMA:
+    case OP_SATURATION:
+        return 0;
+    case OP_SHARPEN:
+        return 1;
+    case OP_MOTION_BLUR:
+        // Half the box across the rows, plus the rounding of the rasterised line
+        return qCeil(op.args[0] / 2 * qAbs(sin(op.args[1] / 180 * M_PI))) + 2;
+    case OP_MEDIAN_FILTER:
+        return (int)op.args[0] / 2;
+    case OP_BOX_BLUR:
+        return qMax((int)op.args[0], 0);
+    case OP_CONVOLVE:
+        return (int)op.args[1] / 2;
+    case OP_NONPHOTOREALISM:
+        return IMAGE_NONPHOTOREALISM_HALO;
+    case OP_GAUSSIAN_BLUR:
+    case OP_GAUSSIAN_BLUR_DIRECT:
+        // The recursive blur reaches further than the direct one's 3 sigma, but its
+        // response beyond 4 sigma is below a tenth of a gray level
+        return qCeil(4 * op.args[0]);
+    case OP_BILATERAL_FILTER:
+    case OP_BILATERAL_FILTER_DIRECT:
+        // Covers the direct filter's window and the grid's splat, blur and slice
+        return qCeil(4 * op.args[0]);
+    default:
+        return -1;
+    }
+}
+
+
+// Reads the input a strip at a time and runs ops on each strip. done(strip, offset, first,
+// count) gets the strip's own rows, which are rows [offset, offset + count) of strip (the
+// rest is the halo ops needed) and rows [first, first + count) of the image
+static void StreamStrips(ImageStripReader &reader, const Operation *ops, int nops, int sampling_method,
+                         int strip_rows, const std::function<void(Image &, int, int, int)> &done)
+{
+    int halo = 0;
+    for (int i = 0; i < nops; i++) {
+        halo += OperationHalo(ops[i]);
+    }
+    int height = reader.Height();
+    Image strip;
+    for (int y0 = 0; y0 < height; y0 += strip_rows) {
+        int y1 = qMin(y0 + strip_rows, height);
+        // Each operation's output is only correct halo rows in from the strip's edges,
+        // except at the edges of the image itself
+        int first = qMax(y0 - halo, 0), end = qMin(y1 + halo, height);
+        bool read = false;
+        Traced("ReadRows", [&]() { read = reader.ReadRows(first, end - first, &strip); });
+        if (!read) {
+            fprintf(stderr, "Unable to read rows %d to %d of the input image\n", first, end - 1);
+            exit(-1);
+        }
+        std::string error;
+        if (!RunOperations(&strip, ops, nops, sampling_method, &error, first)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            exit(-1);
+        }
+        done(strip, y0 - first, y0, y1 - y0);
+    }
+}
+
+
+// Runs ops on the input a strip at a time, writing each strip as soon as it is done, so
+// memory is bounded by the strip size rather than the image size. max_memory (in MB, 0
+// for no limit) picks the strip size
+static void StreamOperations(const char *input_image_name, const char *output_image_name,
+                             Operation *ops, int nops, int sampling_method, int max_memory)
+{
+    int halo = 0;
+    bool median = false, bilateral = false;
+    for (int i = 0; i < nops; i++) {
+        int rows = OperationHalo(ops[i]);
+        if (rows < 0) {
+            fprintf(stderr, "%s cannot be used with -stream or -max_memory\n", ops[i].name);
+            exit(-1);
+        }
+        halo += rows;
+        median |= ops[i].type == OP_MEDIAN_FILTER;
+        bilateral |= ops[i].type == OP_BILATERAL_FILTER;
+    }
+
+    ImageStripReader reader;
+    if (!reader.Open(input_image_name)) {
+        fprintf(stderr, "Unable to read image from %s\n", input_image_name);
+        exit(-1);
+    }
+    // The writer truncates its file before the strips are read
+    if (ImageSameFile(QString(input_image_name), QString(output_image_name))) {
+        fprintf(stderr, "Streamed output %s cannot be the input file\n", output_image_name);
+        exit(-1);
+    }
+    int width = reader.Width(), height = reader.Height();
+
+    int strip_rows = STREAM_STRIP_ROWS;
+    if (max_memory > 0) {
+        // Approximate bytes per strip row: the strip, an operator's output buffer and the
+        // decoded rows, plus a bilateral grid of up to 4 cells of 16 bytes per pixel
+        qint64 row_bytes = (qint64)width * sizeof(ImagePixel) * 4 + (bilateral ? (qint64)width * 64 : 0);
+        // The median filter's column histograms, 3 channels of 272 16-bit bins per thread
+        qint64 fixed = median ? (qint64)width * 3 * 272 * 2 * ImageThreads() : 0;
+        qint64 rows = ((qint64)max_memory * 1024 * 1024 - fixed) / row_bytes;
+        if (rows < 2 * halo + 1) {
+            fprintf(stderr, "A memory limit of %d MB is too small for these operations, they need %d MB\n",
+                    max_memory, (int)(((2 * halo + 1) * row_bytes + fixed) / (1024 * 1024) + 1));
+            exit(-1);
+        }
+        strip_rows = (int)qMin(rows - 2 * halo, (qint64)height);
+    }
+
+    // Contrast needs the average luminance of everything before it, which takes a pass
+    // over the image up to that operation
+    for (int i = 0; i < nops; i++) {
+        if (ops[i].type != OP_CONTRAST) {
+            continue;
+        }
+        ImageStats stats;
+        memset(&stats, 0, sizeof(stats));
+        stats.min = 255;
+        StreamStrips(reader, ops, i, sampling_method, strip_rows, [&](Image &strip, int offset, int, int count) {
+            if (offset > 0 || count < strip.Height()) {
+                strip.Crop(0, offset, strip.Width(), count);
+            }
+            ImageStatsAdd(&stats, strip.Stats());
+        });
+        ops[i].has_average = true;
+        ops[i].average = stats.mean;
+    }
+
+    ImageStripWriter writer;
+    if (!writer.Open(output_image_name, width, height)) {
+        fprintf(stderr, "Unable to write image to %s (streamed output must be a .ppm or .pam file)\n",
+                output_image_name);
+        exit(EXIT_FAILURE);
+    }
+    StreamStrips(reader, ops, nops, sampling_method, strip_rows, [&](Image &strip, int offset, int first, int count) {
+        bool written = false;
+        Traced("WriteRows", [&]() { written = writer.WriteRows(strip, offset, count); });
+        if (!written) {
+            fprintf(stderr, "Unable to write rows starting at %d to %s\n", first, output_image_name);
+            exit(EXIT_FAILURE);
+        }
+    });
+    if (!writer.Close()) {
+        fprintf(stderr, "Unable to write image to %s\n", output_image_name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+// Runs ops on every file in in_dir, writing each result to the file of the same name in
+// out_dir. Files are processed by one worker per thread, so one file's decode, another's
+// operations and another's encode overlap. Returns the number of files that failed
+static int RunBatch(const char *in_dir, const char *out_dir, const Operation *ops, int nops, int sampling_method)
+{
+    QDir input((QString(in_dir)));
+    if (!input.exists()) {
+        fprintf(stderr, "Input directory %s does not exist\n", in_dir);
+        exit(-1);
+    }
+    QDir output((QString(out_dir)));
+    if (!output.exists() && !output.mkpath(".")) {
+        fprintf(stderr, "Unable to create output directory %s\n", out_dir);
+        exit(-1);
+    }
+    QStringList names = input.entryList(QDir::Files, QDir::Name);
+
+    QElapsedTimer timer;
+    timer.start();
+    std::atomic<int> next(0), done(0), failed(0);
+    auto worker = [&]() {
+        for (int i = next++; i < (int)names.size(); i = next++) {
+            QByteArray in = input.filePath(names.at(i)).toLocal8Bit(),
+                       out = output.filePath(names.at(i)).toLocal8Bit();
+            Image image;
+            bool ok = false;
+            Traced("Read", [&]() { ok = image.Read(in.constData(), FormatFromExtension(in.constData())); });
+            if (!ok) {
+                fprintf(stderr, "Unable to read image from %s\n", in.constData());
+                failed++;
+                continue;
+            }
+            std::string error;
+            if (!RunOperations(&image, ops, nops, sampling_method, &error)) {
+                fprintf(stderr, "%s: %s\n", in.constData(), error.c_str());
+                failed++;
+                continue;
+            }
+            Traced("Write", [&]() { ok = image.Write(out.constData(), FormatFromExtension(out.constData())); });
+            if (!ok) {
+                fprintf(stderr, "Unable to write image to %s\n", out.constData());
+                failed++;
+                continue;
+            }
+            done++;
+        }
+    };
+    // The calling thread is the last worker. Operators running while another file holds
+    // the row-band pool run on their worker's thread instead
+    int workers = qMin(ImageThreads(), (int)names.size());
+    std::vector<std::thread> threads;
+    for (int i = 1; i < workers; i++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    double seconds = timer.nsecsElapsed() / 1e9;
+    printf("Processed %d images in %.2f s (%.1f images/s)", (int)done, seconds, seconds > 0 ? done / seconds : 0.0);
+    if (failed > 0) {
+        printf(", %d failed", (int)failed);
+    }
+    printf("\n");
+    return failed;
+}
+
+#ifdef Q_OS_UNIX
+// Longest request line the server accepts
+#define SERVE_REQUEST_LENGTH 4096
+
+// The socket the server listens on
+static const char *serve_socket = NULL;
+
+// The connection the calling server thread is answering, so a request that still ends
+// the worker with exit() (an allocation failure) gets a reply
+static thread_local int serve_client = -1;
+
+// Held by the worker while it accepts a connection, and for good once it is exiting, so
+// the connections queued by then wait on the socket for the next worker instead of
+// being accepted and dropped
+static std::mutex serve_accepting;
+
+// Writes all of reply to client, returning false once the client is gone
+static bool Reply(int client, const char *reply)
+{
+    size_t length = strlen(reply);
+    while (length > 0) {
+        ssize_t n = write(client, reply, length);
+        if (n <= 0) {
+            return false;
+        }
+        reply += n;
+        length -= n;
+    }
+    return true;
+}
+
+static void ReplyRejected(void)
+{
+    serve_accepting.lock();
+    if (serve_client >= 0) {
+        Reply(serve_client, "ERROR request rejected, see the server log\n");
+    }
+}
+
+// Maps shm:<name> to the file of the POSIX shared memory object, so a client can hand
+// over a frame without writing it to disk. Other names are returned unchanged
+static QByteArray ServePath(const char *name)
+{
+    if (!strncmp(name, "shm:", 4)) {
+        return (QString("/dev/shm/") + QString(name + 4)).toLocal8Bit();
+    }
+    return QString(name).toLocal8Bit();
+}
+
+// Runs one request line "<input> <output> [-option [arg ...] ...]" and writes its
+// reply into reply
+static void ServeRequest(char *line, char *reply, int length)
+{
+    std::vector<char *> argv;
+    char *state;
+    for (char *token = strtok_r(line, " \t\r\n", &state); token; token = strtok_r(NULL, " \t\r\n", &state)) {
+        argv.push_back(token);
+    }
+    if (argv.size() < 2) {
+        snprintf(reply, length, "ERROR expected <input> <output> [-option ...]\n");
+        return;
+    }
+    int sampling_method = IMAGE_POINT_SAMPLING;
+    for (size_t i = 2; i < argv.size(); i++) {
+        if (!strcmp(argv[i], "-threads") || !strcmp(argv[i], "-stream") ||
+            !strcmp(argv[i], "-max_memory") || !strcmp(argv[i], "-trace") ||
+            !strcmp(argv[i], "--batch")) {
+            snprintf(reply, length, "ERROR %s cannot be used in a request\n", argv[i]);
+            return;
+        }
+        if (!strcmp(argv[i], "-sampling") && i + 1 < argv.size()) {
+            sampling_method = atoi(argv[i + 1]);
+        }
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    int argc = (int)argv.size() - 2;
+    Operation *ops = new Operation[argc + 1];
+    std::string error;
+    int nops = ParseOperations(argc, argv.data() + 2, ops, &error);
+    if (nops < 0) {
+        snprintf(reply, length, "ERROR %s\n", error.c_str());
+        delete[] ops;
+        return;
+    }
+    QByteArray in = ServePath(argv[0]), out = ServePath(argv[1]);
+    Image image;
+    if (!image.Read(in.constData(), FormatFromExtension(in.constData()))) {
+        snprintf(reply, length, "ERROR unable to read image from %s\n", argv[0]);
+    }
+    else if (!RunOperations(&image, ops, nops, sampling_method, &error)) {
+        snprintf(reply, length, "ERROR %s\n", error.c_str());
+    }
+    else {
+        if (!image.Write(out.constData(), FormatFromExtension(out.constData()))) {
+            snprintf(reply, length, "ERROR unable to write image to %s\n", argv[1]);
+        }
+        else {
+            snprintf(reply, length, "OK %.3f\n", timer.nsecsElapsed() / 1e6);
+        }
+    }
+    FreeOperations(ops, nops);
+}
+
+// Answers the request lines sent on client until it disconnects or sends "quit"
+static void ServeClient(int client)
+{
+    std::vector<char> buffer(SERVE_REQUEST_LENGTH);
+    char reply[SERVE_REQUEST_LENGTH];
+    serve_client = client;
+    size_t used = 0;
+    ssize_t n;
+    while ((n = read(client, &buffer[used], buffer.size() - used)) > 0) {
+        used += n;
+        char *end;
+        while ((end = (char *)memchr(&buffer[0], '\n', used))) {
+            *end = 0;
+            if (!strcmp(&buffer[0], "quit")) {
+                serve_client = -1;
+                unlink(serve_socket);
+                exit(EXIT_SUCCESS);
+            }
+            ServeRequest(&buffer[0], reply, sizeof(reply));
+            if (!Reply(client, reply)) {
+                break;
+            }
+            size_t consumed = end + 1 - &buffer[0];
+            memmove(&buffer[0], end + 1, used - consumed);
+            used -= consumed;
+        }
+        if (used == buffer.size()) {
+            Reply(client, "ERROR request too long\n");
+            break;
+        }
+    }
+    serve_client = -1;
+    close(client);
+}
+
+// Accepts connections on listener for the life of the worker process, each answered
+// on its own thread so an idle client never holds up another
+static void ServeConnections(int listener)
+{
+    atexit(ReplyRejected);
+    // Start the operators' pool now rather than on the first request
+    ImageParallelRows(ImageThreads(), [](int, int) {});
+    for (;;) {
+        // Wait outside the lock, so an exiting worker can take it; this worker is the only
+        // one accepting, so a connection waiting now is still there to accept
+        pollfd waiting = { listener, POLLIN, 0 };
+        if (poll(&waiting, 1, -1) <= 0) {
+            continue;
+        }
+        int client;
+        {
+            std::lock_guard<std::mutex> lock(serve_accepting);
+            client = accept(listener, NULL, NULL);
+        }
+        if (client >= 0) {
+            std::thread(ServeClient, client).detach();
+        }
+    }
+}
+
+// Listens on the Unix domain socket at path and answers requests until a client sends
+// "quit". A worker process holds the threads and buffers between requests. A request
+// with bad options or arguments gets an ERROR reply; if one still ends the worker with
+// exit(), its client is told and a new worker takes over the socket
+static void Serve(const char *path)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        exit(-1);
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(listener, SOMAXCONN) < 0) {
+        fprintf(stderr, "Unable to listen on %s\n", path);
+        exit(-1);
+    }
+    serve_socket = path;
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        pid_t worker = fork();
+        if (worker < 0) {
+            fprintf(stderr, "Unable to start a server worker\n");
+            exit(-1);
+        }
+        if (worker == 0) {
+            ServeConnections(listener);
+        }
+        int status;
+        if (waitpid(worker, &status, 0) < 0) {
+            fprintf(stderr, "Lost the server worker\n");
+            exit(-1);
+        }
+        if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+            break;
+        }
+        fprintf(stderr, "Server worker stopped; starting another\n");
+    }
+    close(listener);
+}
+#endif
+
+
+// Application start point
+int main(int argc, char *argv[])
+{
+    // Look for help
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "-help")) {
             ShowUsage();
         }
     }
 
+    // Set the default sampling method to use
+    int sampling_method = IMAGE_POINT_SAMPLING;
+    // See if a different sampling method was specified
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "-sampling")) {
+            int method = atoi(argv[i+1]);
+            if (method == 0) {
+                sampling_method = IMAGE_POINT_SAMPLING;
+            }
+            else if (method == 1) {
+                sampling_method = IMAGE_BILINEAR_SAMPLING;
+            }
+            else if (method == 2) {
+                sampling_method = IMAGE_GAUSSIAN_SAMPLING;
+            }
+            else if (method == 3) {
+                sampling_method = IMAGE_LANCZOS_SAMPLING;
+            }
+            else if (method == 4) {
+                sampling_method = IMAGE_AREA_SAMPLING;
+            }
+            else {
+                fprintf(stderr, "Sampling method specified incorrectly.\n");
+                ShowUsage();
+                exit(-1);
+            }
+        }
+    }
+
+    // See if the number of threads was specified
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "-threads")) {
+            CheckOption(argv[i], argc - i, 2);
+            int threads = atoi(argv[i+1]);
+            if (threads < 0) {
+                fprintf(stderr, "Number of threads must be nonnegative.\n");
+                ShowUsage();
+            }
+            ImageSetThreads(threads);
+        }
+    }
+
+    // See if the image should be processed in strips
+    bool stream = false;
+    int max_memory = 0;
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "-stream")) {
+            stream = true;
+        }
+        else if (!strcmp(argv[i], "-max_memory")) {
+            CheckOption(argv[i], argc - i, 2);
+            max_memory = atoi(argv[i+1]);
+            if (max_memory <= 0) {
+                fprintf(stderr, "Memory limit must be a positive number of megabytes.\n");
+                ShowUsage();
+            }
+            stream = true;
+        }
+    }
+
+    // See if the operations should be traced
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "-trace")) {
+            CheckOption(argv[i], argc - i, 2);
+            trace_file = fopen(argv[i+1], "w");
+            if (!trace_file) {
+                fprintf(stderr, "Unable to write trace to %s\n", argv[i+1]);
+                exit(-1);
+            }
+            fprintf(trace_file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+            trace_clock.start();
+            atexit(CloseTrace);
+        }
+    }
+
+    // Read input and output image filenames
+    if (argc < 3) ShowUsage();
+    argv++, argc--; // First argument is program name
+    if (!strcmp(*argv, "--serve")) {
+        if (trace_file) {
+            fprintf(stderr, "--serve cannot be combined with -trace\n");
+            exit(-1);
+        }
+#ifdef Q_OS_UNIX
+        Serve(argv[1]);
+        exit(EXIT_SUCCESS);
+#else
+        fprintf(stderr, "--serve needs Unix domain sockets\n");
+        exit(-1);
+#endif
+    }
+    bool batch = !strcmp(*argv, "--batch");
+    if (batch) {
+        if (stream) {
+            fprintf(stderr, "--batch cannot be combined with -stream or -max_memory\n");
+            exit(-1);
+        }
+        argv++, argc--;
+        if (argc < 2) ShowUsage();
+    }
+    char *input_image_name = *argv; argv++, argc--;
+    char *output_image_name = *argv; argv++, argc--;
+
+    // Build the operation graph before doing any work, so bad arguments are
+    // reported before the image is read
+    Operation *ops = new Operation[argc + 1];
+    std::string error;
+    int nops = ParseOperations(argc, argv, ops, &error);
+    if (nops < 0) {
+        fprintf(stderr, "%s\n", error.c_str());
+        if (nops == PARSE_BAD_OPTION) {
+            ShowUsage();
+        }
+        exit(-1);
+    }
+
+    if (batch) {
+        int failed = RunBatch(input_image_name, output_image_name, ops, nops, sampling_method);
+        FreeOperations(ops, nops);
+        exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    if (stream) {
+        StreamOperations(input_image_name, output_image_name, ops, nops, sampling_method, max_memory);
+        FreeOperations(ops, nops);
+        exit(EXIT_SUCCESS);
+    }
+
+    // Allocate memory for image
+    Image *image = new Image();
+    if (!image) {
+        fprintf(stderr, "Unable to allocate image\n");
+        exit(-1);
+    }
+
+    // Read input image
+    bool ok = false;
+    Traced("Read", [&]() { ok = image->Read(input_image_name, FormatFromExtension(input_image_name)); });
+    if (!ok) {
+        fprintf(stderr, "Unable to read image from %s\n", input_image_name);
+        exit(-1);
+    }
+
+    // Perform operations in order (left to right)
+    if (!RunOperations(image, ops, nops, sampling_method, &error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        exit(-1);
+    }
+    FreeOperations(ops, nops);
+
     // Write output image
-    if (!image->Write(output_image_name)) {
+    Traced("Write", [&]() { ok = image->Write(output_image_name, FormatFromExtension(output_image_name)); });
+    if (!ok) {
         fprintf(stderr, "Unable to write image to %s\n", output_image_name);
         exit(EXIT_FAILURE);
     }
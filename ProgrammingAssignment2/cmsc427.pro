@@ -1,9 +1,9 @@
 TEMPLATE = app
-CONFIG += console warn_off release embed_manifest_exe
+CONFIG += console warn_off release embed_manifest_exe c++11
 CONFIG -= app_bundle
 QT += gui
-SOURCES += cmsc427.cpp Image.cpp
-HEADERS += Image.hpp
+SOURCES += cmsc427.cpp Image.cpp ImageConvolve.cpp ImageFft.cpp ImageIntegral.cpp ImageSimd.cpp ImageStream.cpp ImageThreads.cpp
+HEADERS += Image.hpp ImageConvolve.hpp ImageFft.hpp ImageIntegral.hpp ImageSimd.hpp ImageStream.hpp ImageThreads.hpp
 QMAKE_CXXFLAGS += -I/usr/local/include
 unix:macx {
 QMAKE_LFLAGS += -stdlib=libc++